@@ -1,57 +1,943 @@
-__kernel void clgl_pick_selection(float4 O, float4 D, 
-   __global float* vbo, __global ushort* ibo,
-   __global float* t_glob, __local float* t_loc) {
+/* Kernel variants for one class of meshes are built with these defined
+   on the command line, so that the triangle count and floats per vertex
+   become constants. The generic build reads the triangle count from the
+   kernel arguments. */
+#ifndef PICK_VERTEX_STRIDE
+#define PICK_VERTEX_STRIDE 3
+#endif
+#ifdef PICK_TRIANGLES
+#define TRIANGLE_COUNT(n) PICK_TRIANGLES
+#else
+#define TRIANGLE_COUNT(n) (n)
+#endif
 
-  float3 E, F, G, K, L, M;
-  float4 out1;
-  float t_test, t, k, l;
-  ushort3 indices;
-  uint i;
+/* Faces ignored by a pick, numbered as in PickCull. Back faces give a
+   negative determinant. */
+#define PICK_CULL_NONE 0
+#define PICK_CULL_BACK 1
+#define PICK_CULL_FRONT 2
 
-  t_loc[get_local_id(0)] = 10000.0f;
+/* Distance reported for a ray that hits nothing. The host passes the
+   PICK_MISS of pickengine.h, and every kernel compares hits against it. */
+#ifndef PICK_MISS
+#define PICK_MISS MAXFLOAT
+#endif
 
-  if(get_global_id(0) < 528) {
+/* Every pick kernel receives its ray as two float4 values. O.w holds the
+   ray's tolerance, the smallest distance accepted as a hit, and D.w holds
+   its cull mode. */
+
+#ifdef PICK_WATERTIGHT
+
+/* Axes of the watertight test: z is the dominant axis of the direction,
+   and x and y are swapped when the ray points down z to keep the winding */
+uint3 watertight_axes(float3 D) {
+
+  float3 a = fabs(D);
+  float c[3] = {D.x, D.y, D.z};
+  uint kz = (a.x > a.y) ? ((a.x > a.z) ? 0 : 2) : ((a.y > a.z) ? 1 : 2);
+  uint kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+
+  return (c[kz] < 0.0f) ? (uint3)(ky, kx, kz) : (uint3)(kx, ky, kz);
+}
+
+/* Coordinates of v along the axes chosen by watertight_axes() */
+float3 permute_axes(float3 v, uint3 k) {
+  float c[3] = {v.x, v.y, v.z};
+  return (float3)(c[k.x], c[k.y], c[k.z]);
+}
+
+/* Watertight test of Woop, Benthin and Wald, matching
+   PickEngine::intersectWatertight() without its double-precision retry.
+   The vertices are translated to the ray origin and sheared so the ray
+   runs along z, and the signs of the edge functions U, V and W decide the
+   hit. Edges are tested inclusively and evaluated identically by both
+   triangles sharing them, so no ray passes between the two. */
+float intersect_triangle(float4 O, float4 D, float3 K, float3 L, float3 M) {
+
+  uint3 axes = watertight_axes(D.xyz);
+  uint mode = (uint)D.w;
+  float3 dir = permute_axes(D.xyz, axes);
+  float3 A = permute_axes(K - O.xyz, axes);
+  float3 B = permute_axes(L - O.xyz, axes);
+  float3 C = permute_axes(M - O.xyz, axes);
+  float Sx = dir.x/dir.z, Sy = dir.y/dir.z, Sz = 1.0f/dir.z;
+  float Ax, Ay, Bx, By, Cx, Cy, U, V, W, det, side, t;
+
+  /* Shear the vertices and compute the edge functions */
+  Ax = A.x - Sx*A.z;
+  Ay = A.y - Sy*A.z;
+  Bx = B.x - Sx*B.z;
+  By = B.y - Sy*B.z;
+  Cx = C.x - Sx*C.z;
+  Cy = C.y - Sy*C.z;
+  U = Cx*By - Cy*Bx;
+  V = Ax*Cy - Ay*Cx;
+  W = Bx*Ay - By*Ax;
+
+  /* Require the edge functions to share the sign of an unculled face */
+  det = U + V + W;
+  side = (mode == PICK_CULL_NONE) ? ((det < 0.0f) ? -1.0f : 1.0f) : 
+         ((mode == PICK_CULL_FRONT) ? -1.0f : 1.0f);
+  if(U * side < 0.0f || V * side < 0.0f || W * side < 0.0f) {
+    return PICK_MISS;
+  }
+
+  /* Take triangles whose determinant is below the tolerance squared as
+     edge-on, as the default test does */
+  if(det * side <= O.w * O.w) {
+    return PICK_MISS;
+  }
+
+  /* Interpolate the sheared z coordinates to find the distance */
+  t = Sz * (U*A.z + V*B.z + W*C.z)/det;
+  return (t > O.w) ? t : PICK_MISS;
+}
+
+/* Rebuilding K and L from the edges rounds them, so the host doesn't
+   precompute triangles for watertight builds */
+float intersect_edges(float4 O, float4 D, float3 M, float3 E, float3 F) {
+  return intersect_triangle(O, D, M + E, M + F, M);
+}
+
+#else
+
+/* Test a ray against the triangle with vertex M and edges E = K - M and
+   F = L - M, and return its distance, or PICK_MISS on a miss. Triangles
+   whose determinant is below the tolerance squared are taken as edge-on. */
+float intersect_edges(float4 O, float4 D, float3 M, float3 E, float3 F) {
+
+  float3 G;
+  float det, side, t_test, k, l;
+  uint mode = (uint)D.w;
+
+  /* Compute the determinant, flipping its sign for faces that may be hit
+     from behind so the tests below see a positive value */
+  det = dot(cross(D.xyz, F), E);
+  side = (mode == PICK_CULL_NONE) ? sign(det) : 
+         ((mode == PICK_CULL_FRONT) ? -1.0f : 1.0f);
+
+  /* Test determinant */
+  t_test = det * side;
+  if(t_test > O.w * O.w) {
+
+    /* Compute and test k */
+    G = O.xyz - M;
+    k = dot(cross(D.xyz, F), G) * side;
+    if(k > 0.0f && k <= t_test) {
+
+      /* Compute and test l */
+      l = dot(cross(G, E), D.xyz) * side;
+      if(l > 0.0f && k + l <= t_test) {
+
+        /* Compute distance from ray to triangle */
+        k = dot(cross(G, E), F)/det;
+        if(k > O.w) {
+          return k;
+        }
+      }
+    }
+  }
+  return PICK_MISS;
+}
+
+/* Test a ray against triangle KLM and return its distance, or PICK_MISS
+   on a miss */
+float intersect_triangle(float4 O, float4 D, float3 K, float3 L, float3 M) {
+  return intersect_edges(O, D, M, K - M, L - M);
+}
+
+#endif
+
+/* Reduce the work-group's distances so that t_loc[0] and id_loc[0] hold
+   the smallest distance and its id. The halving step handles local sizes
+   that aren't powers of two. */
+void reduce_local_min(__local float* t_loc, __local uint* id_loc) {
+
+  uint lid = get_local_id(0);
+  uint n, upper;
+
+  for(n = get_local_size(0); n > 1; n = upper) {
+    upper = (n + 1)/2;
+    if(lid < n - upper && t_loc[lid + upper] < t_loc[lid]) {
+      t_loc[lid] = t_loc[lid + upper];
+      id_loc[lid] = id_loc[lid + upper];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+}
+
+/* Pick within one object. Each work-item tests every global-size-th
+   triangle, so the host sets how many triangles an item tests through
+   the number of work-groups it launches. */
+__kernel void clgl_pick_selection(float4 O, float4 D,
+   __global float* vbo, __global ushort* ibo, uint num_triangles,
+   __global float* t_glob, __global uint* id_glob,
+   __local float* t_loc, __local uint* id_loc) {
+
+  float3 K, L, M;
+  uint3 indices;
+  float t, t_min = PICK_MISS;
+  uint i, id = UINT_MAX;
+
+  /* Stride over the triangles, keeping the nearest hit in registers */
+  for(i = get_global_id(0); i < TRIANGLE_COUNT(num_triangles); i += get_global_size(0)) {
 
     /* Read coordinates of triangle vertices */
-    indices = vload3(get_global_id(0), ibo);
+    indices = convert_uint3(vload3(i, ibo));
+    K = vload3(0, vbo + indices.x * PICK_VERTEX_STRIDE);
+    L = vload3(0, vbo + indices.y * PICK_VERTEX_STRIDE);
+    M = vload3(0, vbo + indices.z * PICK_VERTEX_STRIDE);
+
+    t = intersect_triangle(O, D, K, L, M);
+    if(t < t_min) {
+      t_min = t;
+      id = i;
+    }
+  }
+  t_loc[get_local_id(0)] = t_min;
+  id_loc[get_local_id(0)] = id;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  /* Find smallest t and the triangle it belongs to */
+  reduce_local_min(t_loc, id_loc);
+  if(get_local_id(0) == 0) {
+    t_glob[get_group_id(0)] = t_loc[0];
+    id_glob[get_group_id(0)] = id_loc[0];
+  }
+}
+
+/* Pick within one object whose triangles were stored by the host as
+   nine runs of num_triangles floats: the x, y and z coordinates of M,
+   then those of E and F. Neighboring work-items read neighboring
+   floats, and no indices or edge vectors are needed. */
+__kernel void clgl_pick_precomputed(float4 O, float4 D,
+   __global float* tris, uint num_triangles,
+   __global float* t_glob, __global uint* id_glob,
+   __local float* t_loc, __local uint* id_loc) {
+
+  float3 M, E, F;
+  float t, t_min = PICK_MISS;
+  uint i, n = TRIANGLE_COUNT(num_triangles), id = UINT_MAX;
+
+  for(i = get_global_id(0); i < n; i += get_global_size(0)) {
+    M = (float3)(tris[i], tris[n + i], tris[2*n + i]);
+    E = (float3)(tris[3*n + i], tris[4*n + i], tris[5*n + i]);
+    F = (float3)(tris[6*n + i], tris[7*n + i], tris[8*n + i]);
+    t = intersect_edges(O, D, M, E, F);
+    if(t < t_min) {
+      t_min = t;
+      id = i;
+    }
+  }
+  t_loc[get_local_id(0)] = t_min;
+  id_loc[get_local_id(0)] = id;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  /* Find smallest t and the triangle it belongs to */
+  reduce_local_min(t_loc, id_loc);
+  if(get_local_id(0) == 0) {
+    t_glob[get_group_id(0)] = t_loc[0];
+    id_glob[get_group_id(0)] = id_loc[0];
+  }
+}
+
+/* Test triangles [first, last) of the concatenated scene, each work-item
+   striding by the global size, and leave the work-group's nearest hit in
+   t_loc[0] and id_loc[0]. The id of a hit is its scene triangle index. */
+void pick_scene_range(float4 O, float4 D,
+   __global float* vbo, __global uint* ibo, uint first, uint last,
+   __local float* t_loc, __local uint* id_loc) {
+
+  float3 K, L, M;
+  uint3 indices;
+  float t, t_min = PICK_MISS;
+  uint i, id = UINT_MAX;
+
+  /* Stride over the triangles, keeping the nearest hit in registers */
+  for(i = first + get_global_id(0); i < last; i += get_global_size(0)) {
+
+    /* Read coordinates of triangle vertices */
+    indices = vload3(i, ibo);
+    K = vload3(indices.x, vbo);
+    L = vload3(indices.y, vbo);
+    M = vload3(indices.z, vbo);
+
+    t = intersect_triangle(O, D, K, L, M);
+    if(t < t_min) {
+      t_min = t;
+      id = i;
+    }
+  }
+  t_loc[get_local_id(0)] = t_min;
+  id_loc[get_local_id(0)] = id;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  reduce_local_min(t_loc, id_loc);
+}
+
+/* Test every triangle of the scene in a single launch. The vertices and
+   indices of all objects are concatenated, and the id of each hit is its
+   scene triangle index, which the host maps back to an object. */
+__kernel void clgl_pick_scene(float4 O, float4 D,
+   __global float* vbo, __global uint* ibo,
+   uint num_triangles, __global float* t_glob, __global uint* id_glob,
+   __local float* t_loc, __local uint* id_loc) {
+
+  /* Find smallest t and its triangle */
+  pick_scene_range(O, D, vbo, ibo, 0, num_triangles, t_loc, id_loc);
+  if(get_local_id(0) == 0) {
+    t_glob[get_group_id(0)] = t_loc[0];
+    id_glob[get_group_id(0)] = id_loc[0];
+  }
+}
+
+/* Test the count triangles starting at first. The multi-device scheduler
+   gives each device its own range of the scene. */
+__kernel void clgl_pick_range(float4 O, float4 D,
+   __global float* vbo, __global uint* ibo, uint first, uint count,
+   __global float* t_glob, __global uint* id_glob,
+   __local float* t_loc, __local uint* id_loc) {
+
+  pick_scene_range(O, D, vbo, ibo, first, first + count, t_loc, id_loc);
+  if(get_local_id(0) == 0) {
+    t_glob[get_group_id(0)] = t_loc[0];
+    id_glob[get_group_id(0)] = id_loc[0];
+  }
+}
+
+/* Second stage: a single work-group reduces the per-group results of a
+   pick kernel and stores the smallest distance in slot out_index */
+__kernel void clgl_reduce_min(__global float* t_glob, __global uint* id_glob,
+   uint count, __global float* t_result, __global uint* id_result,
+   uint out_index, __local float* t_loc, __local uint* id_loc) {
+
+  float t = PICK_MISS;
+  uint i, id = UINT_MAX;
+
+  /* Each work-item scans a strided slice of the per-group results */
+  for(i = get_local_id(0); i < count; i += get_local_size(0)) {
+    if(t_glob[i] < t) {
+      t = t_glob[i];
+      id = id_glob[i];
+    }
+  }
+  t_loc[get_local_id(0)] = t;
+  id_loc[get_local_id(0)] = id;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  reduce_local_min(t_loc, id_loc);
+  if(get_local_id(0) == 0) {
+    t_result[out_index] = t_loc[0];
+    id_result[out_index] = id_loc[0];
+  }
+}
+
+/* Packets of PICK_VEC_WIDTH triangles in structure-of-arrays form. Each
+   packet holds the x coordinates of every triangle's K vertex, then the
+   y and z coordinates, then those of L and M. PickEngine::packTriangles
+   fills unused lanes with degenerate triangles, which always miss. */
+#ifndef PICK_VEC_WIDTH
+#define PICK_VEC_WIDTH 4
+#endif
+
+#if PICK_VEC_WIDTH == 8
+typedef float8 floatv;
+typedef uint8 uintv;
+#define as_uintv as_uint8
+#define vloadv vload8
+#define vstorev vstore8
+#else
+typedef float4 floatv;
+typedef uint4 uintv;
+#define as_uintv as_uint4
+#define vloadv vload4
+#define vstorev vstore4
+#endif
+
+#ifdef PICK_WATERTIGHT
+
+/* Watertight test of every triangle of a packet, with the arithmetic of
+   intersect_triangle(). The axis permutation only changes which runs of
+   the packet are loaded. */
+floatv intersect_packet(float4 O, float4 D, __global float* packet) {
+
+  uint3 axes = watertight_axes(D.xyz);
+  uint mode = (uint)D.w;
+  float3 dir = permute_axes(D.xyz, axes), org = permute_axes(O.xyz, axes);
+  float Sx = dir.x/dir.z, Sy = dir.y/dir.z, Sz = 1.0f/dir.z;
+  floatv Az = vloadv(axes.z, packet) - org.z;
+  floatv Bz = vloadv(3 + axes.z, packet) - org.z;
+  floatv Cz = vloadv(6 + axes.z, packet) - org.z;
+  floatv Ax = vloadv(axes.x, packet) - org.x - Sx*Az;
+  floatv Ay = vloadv(axes.y, packet) - org.y - Sy*Az;
+  floatv Bx = vloadv(3 + axes.x, packet) - org.x - Sx*Bz;
+  floatv By = vloadv(3 + axes.y, packet) - org.y - Sy*Bz;
+  floatv Cx = vloadv(6 + axes.x, packet) - org.x - Sx*Cz;
+  floatv Cy = vloadv(6 + axes.y, packet) - org.y - Sy*Cz;
+  floatv U, V, W, det, side, t;
+  uintv hit;
+
+  /* Compute the edge functions and the distance */
+  U = Cx*By - Cy*Bx;
+  V = Ax*Cy - Ay*Cx;
+  W = Bx*Ay - By*Ax;
+  det = U + V + W;
+  t = Sz * (U*Az + V*Bz + W*Cz)/det;
+
+  /* Apply the tests of the scalar version to every lane at once */
+  side = (mode == PICK_CULL_NONE) ? select((floatv)(1.0f), (floatv)(-1.0f), 
+                                           as_uintv(det < 0.0f)) : 
+         (floatv)((mode == PICK_CULL_FRONT) ? -1.0f : 1.0f);
+  hit = as_uintv(U * side >= 0.0f) & as_uintv(V * side >= 0.0f) & 
+        as_uintv(W * side >= 0.0f) & as_uintv(det * side > O.w * O.w) & 
+        as_uintv(t > O.w);
+  return select((floatv)(PICK_MISS), t, hit);
+}
+
+#else
+
+/* Test a ray against every triangle of a packet with the same arithmetic
+   as intersect_triangle(), returning PICK_MISS in the lanes that miss */
+floatv intersect_packet(float4 O, float4 D, __global float* packet) {
+
+  floatv Mx = vloadv(6, packet), My = vloadv(7, packet), Mz = vloadv(8, packet);
+  floatv Ex = vloadv(0, packet) - Mx, Ey = vloadv(1, packet) - My, Ez = vloadv(2, packet) - Mz;
+  floatv Fx = vloadv(3, packet) - Mx, Fy = vloadv(4, packet) - My, Fz = vloadv(5, packet) - Mz;
+  floatv Px, Py, Pz, Gx, Gy, Gz, Qx, Qy, Qz, det, side, k, l, t;
+  uint mode = (uint)D.w;
+  uintv hit;
+
+  /* Compute the determinant and k from P = D x F */
+  Px = D.y*Fz - D.z*Fy;
+  Py = D.z*Fx - D.x*Fz;
+  Pz = D.x*Fy - D.y*Fx;
+  det = Px*Ex + Py*Ey + Pz*Ez;
+  Gx = O.x - Mx;
+  Gy = O.y - My;
+  Gz = O.z - Mz;
+  k = Px*Gx + Py*Gy + Pz*Gz;
+
+  /* Compute l and the distance from Q = G x E */
+  Qx = Gy*Ez - Gz*Ey;
+  Qy = Gz*Ex - Gx*Ez;
+  Qz = Gx*Ey - Gy*Ex;
+  l = Qx*D.x + Qy*D.y + Qz*D.z;
+  t = (Qx*Fx + Qy*Fy + Qz*Fz)/det;
+
+  /* Apply the tests of the scalar version to every lane at once */
+  side = (mode == PICK_CULL_NONE) ? sign(det) : 
+         (floatv)((mode == PICK_CULL_FRONT) ? -1.0f : 1.0f);
+  det *= side;
+  k *= side;
+  l *= side;
+  hit = as_uintv(det > O.w * O.w) & as_uintv(k > 0.0f) & as_uintv(k <= det) & 
+        as_uintv(l > 0.0f) & as_uintv(k + l <= det) & as_uintv(t > O.w);
+  return select((floatv)(PICK_MISS), t, hit);
+}
+
+#endif
+
+/* Scene pick in which each work-item strides over packets of triangles,
+   keeping the nearest hit of each lane in registers. The id of a hit is
+   its scene triangle index, as in clgl_pick_scene. */
+__kernel void clgl_pick_vector(float4 O, float4 D,
+   __global float* packets, uint num_packets,
+   __global float* t_glob, __global uint* id_glob,
+   __local float* t_loc, __local uint* id_loc) {
+
+  floatv t, t_lanes = (floatv)(PICK_MISS);
+  uintv packet_lanes = (uintv)(UINT_MAX);
+  float t_min[PICK_VEC_WIDTH];
+  uint packet_min[PICK_VEC_WIDTH];
+  uint i, j, id = UINT_MAX;
+  float t_best = PICK_MISS;
+
+  for(i = get_global_id(0); i < num_packets; i += get_global_size(0)) {
+    t = intersect_packet(O, D, packets + i * 9 * PICK_VEC_WIDTH);
+    packet_lanes = select(packet_lanes, (uintv)(i), as_uintv(t < t_lanes));
+    t_lanes = fmin(t, t_lanes);
+  }
+
+  /* Find the nearest lane and convert it to a triangle index */
+  vstorev(t_lanes, 0, t_min);
+  vstorev(packet_lanes, 0, packet_min);
+  for(j = 0; j < PICK_VEC_WIDTH; j++) {
+    if(t_min[j] < t_best) {
+      t_best = t_min[j];
+      id = packet_min[j] * PICK_VEC_WIDTH + j;
+    }
+  }
+  t_loc[get_local_id(0)] = t_best;
+  id_loc[get_local_id(0)] = id;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  /* Find smallest t and its triangle */
+  reduce_local_min(t_loc, id_loc);
+  if(get_local_id(0) == 0) {
+    t_glob[get_group_id(0)] = t_loc[0];
+    id_glob[get_group_id(0)] = id_loc[0];
+  }
+}
+
+#ifdef cl_khr_int64_extended_atomics
+#pragma OPENCL EXTENSION cl_khr_int64_extended_atomics : enable
+
+/* Scene pick that leaves its answer in a single 64-bit slot. Positive
+   floats order the same way as their bit patterns, so each group packs
+   its distance above the scene triangle index and atomically keeps the
+   smallest key. The host clears the slot to ULONG_MAX before launching. */
+__kernel void clgl_pick_atomic(float4 O, float4 D,
+   __global float* vbo, __global uint* ibo, uint num_triangles,
+   __global ulong* result, __local float* t_loc, __local uint* id_loc) {
+
+  /* Publish the group's nearest hit */
+  pick_scene_range(O, D, vbo, ibo, 0, num_triangles, t_loc, id_loc);
+  if(get_local_id(0) == 0 && t_loc[0] < PICK_MISS) {
+    atom_min(result, ((ulong)as_uint(t_loc[0]) << 32) | id_loc[0]);
+  }
+}
+#endif
+
+/* Number of hits each work-group of clgl_pick_nearest keeps */
+#ifndef PICK_K
+#define PICK_K 4
+#endif
+
+/* Pick-through: append every hit along the ray to hit_t and hit_id.
+   hit_count, cleared by the host, ends up holding the number of hits,
+   which may exceed max_hits, the capacity of the lists. */
+__kernel void clgl_pick_all(float4 O, float4 D,
+   __global float* vbo, __global uint* ibo, uint num_triangles,
+   __global float* hit_t, __global uint* hit_id,
+   __global uint* hit_count, uint max_hits) {
+
+  float3 K, L, M;
+  uint3 indices;
+  float t;
+  uint i, slot;
+
+  for(i = get_global_id(0); i < num_triangles; i += get_global_size(0)) {
+    indices = vload3(i, ibo);
     K = vload3(indices.x, vbo);
     L = vload3(indices.y, vbo);
     M = vload3(indices.z, vbo);
+    t = intersect_triangle(O, D, K, L, M);
+    if(t < PICK_MISS) {
+      slot = atomic_inc(hit_count);
+      if(slot < max_hits) {
+        hit_t[slot] = t;
+        hit_id[slot] = i;
+      }
+    }
+  }
+}
 
-    /* Compute vectors */
-    E = K - M;
-    F = L - M;
+/* Pick-through limited to the PICK_K nearest hits of each work-group.
+   Each work-item keeps a sorted list of its nearest hits in registers,
+   the lists are merged pairwise in local memory, and the group appends
+   the hits of the merged list as clgl_pick_all does. t_loc and id_loc
+   hold PICK_K entries per work-item. */
+__kernel void clgl_pick_nearest(float4 O, float4 D,
+   __global float* vbo, __global uint* ibo, uint num_triangles,
+   __global float* hit_t, __global uint* hit_id,
+   __global uint* hit_count, uint max_hits,
+   __local float* t_loc, __local uint* id_loc) {
 
-    /* Compute and test determinant */
-    t_test = dot(cross(D.s012, F), E);
-    if(t_test > 0.0001f) {
+  float3 K, L, M;
+  uint3 indices;
+  float t, t_list[PICK_K], t_other[PICK_K];
+  uint i, j, a, b, n, upper, slot, id_list[PICK_K], id_other[PICK_K];
+  uint lid = get_local_id(0);
 
-      /* Compute and test k */
-      G = O.s012 - M;
-      k = dot(cross(D.s012, F), G);
-      if(k > 0.0f && k <= t_test) {
+  for(j = 0; j < PICK_K; j++) {
+    t_list[j] = PICK_MISS;
+    id_list[j] = UINT_MAX;
+  }
 
-        /* Compute and test l */
-        l = dot(cross(G, E), D.s012);
-        if(l > 0.0f && k + l <= t_test) {
+  /* Insert each hit into the work-item's sorted list */
+  for(i = get_global_id(0); i < num_triangles; i += get_global_size(0)) {
+    indices = vload3(i, ibo);
+    K = vload3(indices.x, vbo);
+    L = vload3(indices.y, vbo);
+    M = vload3(indices.z, vbo);
+    t = intersect_triangle(O, D, K, L, M);
+    if(t < t_list[PICK_K-1]) {
+      for(j = PICK_K-1; j > 0 && t_list[j-1] > t; j--) {
+        t_list[j] = t_list[j-1];
+        id_list[j] = id_list[j-1];
+      }
+      t_list[j] = t;
+      id_list[j] = i;
+    }
+  }
+  for(j = 0; j < PICK_K; j++) {
+    t_loc[lid*PICK_K + j] = t_list[j];
+    id_loc[lid*PICK_K + j] = id_list[j];
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
 
-          /* Compute distance from ray to triangle */
-          t_loc[get_local_id(0)] = dot(cross(G, E), F)/t_test;
+  /* Merge the upper half of the lists into the lower half, keeping the
+     nearest PICK_K hits, with the halving of reduce_local_min() */
+  for(n = get_local_size(0); n > 1; n = upper) {
+    upper = (n + 1)/2;
+    if(lid < n - upper) {
+      for(j = 0; j < PICK_K; j++) {
+        t_other[j] = t_loc[(lid + upper)*PICK_K + j];
+        id_other[j] = id_loc[(lid + upper)*PICK_K + j];
+      }
+      a = 0;
+      b = 0;
+      for(j = 0; j < PICK_K; j++) {
+        if(t_list[a] <= t_other[b]) {
+          t_loc[lid*PICK_K + j] = t_list[a];
+          id_loc[lid*PICK_K + j] = id_list[a++];
+        }
+        else {
+          t_loc[lid*PICK_K + j] = t_other[b];
+          id_loc[lid*PICK_K + j] = id_other[b++];
         }
       }
+      for(j = 0; j < PICK_K; j++) {
+        t_list[j] = t_loc[lid*PICK_K + j];
+        id_list[j] = id_loc[lid*PICK_K + j];
+      }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  /* Append the group's hits */
+  if(lid == 0) {
+    for(n = 0; n < PICK_K && t_list[n] < PICK_MISS; n++);
+    if(n > 0) {
+      slot = atomic_add(hit_count, n);
+      for(j = 0; j < n && slot + j < max_hits; j++) {
+        hit_t[slot + j] = t_list[j];
+        hit_id[slot + j] = id_list[j];
+      }
     }
   }
+}
+
+/* Sort the hits appended by clgl_pick_all or clgl_pick_nearest by
+   distance, then triangle, with a bitonic sort run by a single work-group.
+   The lists are padded with misses to a power of two in t_loc and id_loc,
+   which hold max_hits entries. */
+__kernel void clgl_sort_hits(__global float* hit_t, __global uint* hit_id,
+   __global uint* hit_count, uint max_hits,
+   __local float* t_loc, __local uint* id_loc) {
+
+  uint count = min(*hit_count, max_hits), n = 1, i, j, k, partner, id;
+  uint lid = get_local_id(0), size = get_local_size(0);
+  float t;
+  bool ascending, swap;
+
+  while(n < count) {
+    n <<= 1;
+  }
+  for(i = lid; i < n; i += size) {
+    t_loc[i] = (i < count) ? hit_t[i] : PICK_MISS;
+    id_loc[i] = (i < count) ? hit_id[i] : UINT_MAX;
+  }
   barrier(CLK_LOCAL_MEM_FENCE);
 
-  /* Cycle through values to find smallest t */
-  if(get_local_id(0) == 0) {
+  for(k = 2; k <= n; k <<= 1) {
+    for(j = k >> 1; j > 0; j >>= 1) {
+      for(i = lid; i < n; i += size) {
+        partner = i ^ j;
+        if(partner > i) {
+          ascending = (i & k) == 0;
+          swap = (t_loc[i] > t_loc[partner]) ||
+                 (t_loc[i] == t_loc[partner] && id_loc[i] > id_loc[partner]);
+          if(swap == ascending) {
+            t = t_loc[i];
+            t_loc[i] = t_loc[partner];
+            t_loc[partner] = t;
+            id = id_loc[i];
+            id_loc[i] = id_loc[partner];
+            id_loc[partner] = id;
+          }
+        }
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+    }
+  }
+
+  for(i = lid; i < count; i += size) {
+    hit_t[i] = t_loc[i];
+    hit_id[i] = id_loc[i];
+  }
+}
+
+/* Relation of an object to a box selection, as in pickengine.h */
+#define SELECT_OUT 0
+#define SELECT_IN 1
+#define SELECT_CHECK 2
+
+/* The selection volume is given by six planes, with p inside plane i
+   when dot(frustum[i], (p, 1)) >= 0, followed by its eight corners */
+#define FRUSTUM_PLANES 6
+#define FRUSTUM_CORNERS 8
+
+/* Classify the box of each object against the frustum. A box is outside
+   if its farthest corner along a plane's normal is outside that plane,
+   and inside if its nearest corner is inside every plane. Boxes inside
+   are given inside_state, which lasso selection sets to SELECT_CHECK
+   since its frustum only bounds the lasso. */
+__kernel void clgl_select_objects(__constant float4* frustum,
+   __global float* boxes, uint num_objects, __global uchar* object_state,
+   uchar inside_state) {
+
+  uint i = get_global_id(0), j;
+  float3 lo, hi, n, p_far, p_near;
+  uchar state = inside_state;
+
+  if(i >= num_objects) {
+    return;
+  }
+  lo = vload3(2*i, boxes);
+  hi = vload3(2*i + 1, boxes);
+  for(j = 0; j < FRUSTUM_PLANES; j++) {
+    n = frustum[j].xyz;
+    p_far = select(lo, hi, isgreaterequal(n, (float3)(0.0f)));
+    p_near = select(hi, lo, isgreaterequal(n, (float3)(0.0f)));
+    if(dot(n, p_far) + frustum[j].w < 0.0f) {
+      state = SELECT_OUT;
+      break;
+    }
+    if(dot(n, p_near) + frustum[j].w < 0.0f) {
+      state = SELECT_CHECK;
+    }
+  }
+  object_state[i] = state;
+}
 
-    t_test = 1000.0f;
-    for(i=0; i<get_local_size(0); i++) {
-      if(t_loc[i] > 0.0001f && t_loc[i] < t_test) {
-        t_test = t_loc[i];
+/* Test the triangles of objects whose boxes straddle the frustum, as
+   PickEngine::triangleInFrustum() does, and select the object of any
+   triangle inside. Work-items only ever store SELECT_IN, so concurrent
+   stores to the same object agree. */
+__kernel void clgl_select_triangles(__constant float4* frustum,
+   __global float* vbo, __global uint* ibo, uint num_triangles,
+   __global uint* triangle_objects, __global uchar* object_state) {
+
+  float3 K, L, M, n;
+  uint3 indices;
+  uint i, j, object, above, below;
+  float d;
+  bool outside;
+
+  for(i = get_global_id(0); i < num_triangles; i += get_global_size(0)) {
+    object = triangle_objects[i];
+    if(object_state[object] != SELECT_CHECK) {
+      continue;
+    }
+    indices = vload3(i, ibo);
+    K = vload3(indices.x, vbo);
+    L = vload3(indices.y, vbo);
+    M = vload3(indices.z, vbo);
+
+    /* Reject triangles outside one of the planes */
+    outside = false;
+    for(j = 0; j < FRUSTUM_PLANES && !outside; j++) {
+      n = frustum[j].xyz;
+      d = frustum[j].w;
+      outside = dot(n, K) + d < 0.0f && dot(n, L) + d < 0.0f && dot(n, M) + d < 0.0f;
+    }
+
+    /* Reject triangles whose plane passes beside the frustum */
+    n = cross(L - K, M - K);
+    above = 0;
+    below = 0;
+    for(j = 0; j < FRUSTUM_CORNERS && !outside; j++) {
+      d = dot(n, frustum[FRUSTUM_PLANES + j].xyz - K);
+      above += (d > 0.0f);
+      below += (d < 0.0f);
+    }
+    if(!outside && above < FRUSTUM_CORNERS && below < FRUSTUM_CORNERS) {
+      object_state[object] = SELECT_IN;
+    }
+  }
+}
+
+/* Same test as PickEngine::pointInPolygon(). Each edge crossing the
+   horizontal line through p to the right of p flips the result. */
+bool point_in_polygon(float2 p, __constant float2* polygon, uint num_points) {
+
+  bool inside = false;
+  uint j, k;
+  float2 a, b;
+
+  for(j = 0, k = num_points - 1; j < num_points; k = j++) {
+    a = polygon[j];
+    b = polygon[k];
+    if((a.y > p.y) != (b.y > p.y) &&
+       p.x < (b.x - a.x) * (p.y - a.y) / (b.y - a.y) + a.x) {
+      inside = !inside;
+    }
+  }
+  return inside;
+}
+
+/* Lasso selection: project the vertices of objects left for checking by
+   clgl_select_objects with the column-major MVP matrix, and select the
+   object of any vertex landing inside the polygon. Vertices at or behind
+   the eye have no screen position and are skipped. */
+__kernel void clgl_select_lasso(float16 mvp,
+   __constant float2* polygon, uint num_points,
+   __global float* vbo, uint num_vertices,
+   __global uint* vertex_objects, __global uchar* object_state) {
+
+  uint i, object;
+  float3 V;
+  float4 clip;
+
+  for(i = get_global_id(0); i < num_vertices; i += get_global_size(0)) {
+    object = vertex_objects[i];
+    if(object_state[object] != SELECT_CHECK) {
+      continue;
+    }
+    V = vload3(i, vbo);
+    clip = mvp.s0123 * V.x + mvp.s4567 * V.y + mvp.s89ab * V.z + mvp.scdef;
+    if(clip.w > 0.0f && clip.z >= -clip.w && clip.z <= clip.w &&
+       point_in_polygon(clip.xy / clip.w, polygon, num_points)) {
+      object_state[object] = SELECT_IN;
+    }
+  }
+}
+
+#define BVH_STACK_SIZE 64
+#define BVH_BOX_TOLERANCE 1.0000004f
+#define BVH_MIN_DIRECTION 1e-20f
+
+/* Slab test returning the distance at which the ray enters the box, or -1
+   if it misses the box or only enters it beyond t_max. The exit distance
+   is widened by the rounding error of the slab arithmetic, and slabs
+   parallel to the ray contain it or reject it, as in
+   PickBVH::intersectBox(). */
+float intersect_box(float3 O, float3 inv_dir, float3 lo, float3 hi, float t_max) {
+
+  int3 parallel = fabs(inv_dir) >= 1.0f/BVH_MIN_DIRECTION;
+  float3 t0 = (lo - O) * inv_dir;
+  float3 t1 = (hi - O) * inv_dir;
+  float3 t_near = select(fmin(t0, t1), (float3)(-MAXFLOAT), parallel);
+  float3 t_far = select(fmax(t0, t1) * BVH_BOX_TOLERANCE, (float3)(MAXFLOAT), parallel);
+  float t_enter = fmax(fmax(t_near.x, t_near.y), fmax(t_near.z, 0.0f));
+  float t_exit = fmin(fmin(t_far.x, t_far.y), fmin(t_far.z, t_max));
+
+  if(any(parallel & ((O < lo) | (O > hi)))) {
+    return -1.0f;
+  }
+  return (t_enter <= t_exit) ? t_enter : -1.0f;
+}
+
+/* Reciprocal of the direction, with zero components replaced by a tiny
+   value of the same sign so that intersect_box() never computes 0 * inf */
+float3 inverse_direction(float3 D) {
+  return 1.0f / select(D, copysign((float3)(BVH_MIN_DIRECTION), D), 
+                       fabs(D) < BVH_MIN_DIRECTION);
+}
+
+/* Find the nearest triangle by traversing the flattened BVH built by
+   PickBVH. Node i occupies nodes[2*i] (minimum corner, first) and
+   nodes[2*i+1] (maximum corner, count), and the left child of an
+   interior node is the node that follows it. */
+float traverse_bvh(float4 O, float4 D, __global float4* nodes,
+   __global uint* tri_order, __global float* vbo, __global uint* ibo,
+   uint* triangle) {
+
+  uint stack[BVH_STACK_SIZE], stack_size = 0, index = 0;
+  uint i, first, count, near_child, far_child, tmp;
+  float stack_t[BVH_STACK_SIZE], t_best = PICK_MISS, t, t_near, t_far;
+  float3 inv_dir = inverse_direction(D.xyz);
+  float4 lo, hi;
+  uint3 indices;
+
+  *triangle = UINT_MAX;
+  if(intersect_box(O.xyz, inv_dir, nodes[0].xyz, nodes[1].xyz, t_best) < 0.0f) {
+    return t_best;
+  }
+
+  while(1) {
+    lo = nodes[2*index];
+    hi = nodes[2*index+1];
+    first = as_uint(lo.w);
+    count = as_uint(hi.w);
+
+    /* Test the triangles of a leaf */
+    if(count > 0) {
+      for(i=first; i<first+count; i++) {
+        indices = vload3(tri_order[i], ibo);
+        t = intersect_triangle(O, D, vload3(indices.x, vbo),
+                               vload3(indices.y, vbo), vload3(indices.z, vbo));
+        if(t < t_best) {
+          t_best = t;
+          *triangle = tri_order[i];
+        }
       }
     }
-    t_glob[get_group_id(0)] = t_test;
+
+    /* Visit the nearer child and push the farther one */
+    else {
+      near_child = index + 1;
+      far_child = first;
+      t_near = intersect_box(O.xyz, inv_dir, nodes[2*near_child].xyz, 
+                             nodes[2*near_child+1].xyz, t_best);
+      t_far = intersect_box(O.xyz, inv_dir, nodes[2*far_child].xyz, 
+                            nodes[2*far_child+1].xyz, t_best);
+      if(t_far >= 0.0f && (t_near < 0.0f || t_far < t_near)) {
+        tmp = near_child; near_child = far_child; far_child = tmp;
+        t = t_near; t_near = t_far; t_far = t;
+      }
+      if(t_near >= 0.0f) {
+        if(t_far >= 0.0f) {
+          stack[stack_size] = far_child;
+          stack_t[stack_size++] = t_far;
+        }
+        index = near_child;
+        continue;
+      }
+    }
+
+    /* Pop the next subtree that starts before the nearest hit */
+    do {
+      if(stack_size == 0) {
+        return t_best;
+      }
+      stack_size--;
+    } while(stack_t[stack_size] >= t_best);
+    index = stack[stack_size];
+  }
+  return t_best;
+}
+
+/* Pick with a single work-item traversing the scene BVH */
+__kernel void clgl_pick_bvh(float4 O, float4 D, __global float4* nodes,
+   __global uint* tri_order, __global float* vbo, __global uint* ibo,
+   __global float* t_result, __global uint* id_result) {
+
+  uint triangle;
+  float t = traverse_bvh(O, D, nodes, tri_order, vbo, ibo, &triangle);
+
+  if(get_global_id(0) == 0) {
+    t_result[0] = t;
+    id_result[0] = triangle;
+  }
+}
+
+/* Pick a batch of rays, one work-item per ray. rays[2*i] holds the
+   origin of ray i and rays[2*i+1] its direction. */
+__kernel void clgl_pick_batch(__global float4* rays, uint num_rays,
+   __global float4* nodes, __global uint* tri_order,
+   __global float* vbo, __global uint* ibo,
+   __global float* t_out, __global uint* id_out) {
+
+  uint i = get_global_id(0), triangle;
+  float t;
+
+  if(i < num_rays) {
+    t = traverse_bvh(rays[2*i], rays[2*i+1], nodes, tri_order, 
+                     vbo, ibo, &triangle);
+    t_out[i] = t;
+    id_out[i] = triangle;
   }
 }
@@ -2,6 +2,29 @@
 #define FRAGMENT_SHADER "clgl_pick_selection.frag"
 #define PROGRAM_FILE "clgl_pick_selection.cl"
 #define KERNEL_FUNC "clgl_pick_selection"
+#define SCENE_KERNEL_FUNC "clgl_pick_scene"
+#define REDUCE_KERNEL_FUNC "clgl_reduce_min"
+#define ATOMIC_KERNEL_FUNC "clgl_pick_atomic"
+#define BVH_KERNEL_FUNC "clgl_pick_bvh"
+#define BATCH_KERNEL_FUNC "clgl_pick_batch"
+#define VECTOR_KERNEL_FUNC "clgl_pick_vector"
+#define PRECOMPUTED_KERNEL_FUNC "clgl_pick_precomputed"
+#define ALL_HITS_KERNEL_FUNC "clgl_pick_all"
+#define NEAREST_KERNEL_FUNC "clgl_pick_nearest"
+#define SORT_KERNEL_FUNC "clgl_sort_hits"
+#define SELECT_OBJECTS_KERNEL_FUNC "clgl_select_objects"
+#define SELECT_TRIANGLES_KERNEL_FUNC "clgl_select_triangles"
+#define LASSO_KERNEL_FUNC "clgl_select_lasso"
+#define MAX_LASSO_POINTS 512
+#define LASSO_SPACING 4           // Pixels between recorded lasso points
+#define MAX_HITS 256
+#define NEAREST_HITS 4
+#define GRID_SIZE 64
+#define ATOMICS_EXTENSION "cl_khr_int64_extended_atomics"
+#define GL_EVENT_EXTENSION "cl_khr_gl_event"
+#define PICK_POLL_MS 1
+#define HOVER_INTERVAL_MS 16      // Shortest time between hover picks
+#define MAX_KERNEL_VARIANTS 8
 
 // OpenCL headers
 #include <CL/cl_gl.h>
@@ -22,11 +45,60 @@
 // Read from COLLADA files
 #include "colladainterface.h"
 
+// Pick without OpenCL
+#include "pickengine.h"
+
+// Reuse compiled OpenCL programs
+#include "programcache.h"
+
+// Pick on several OpenCL devices at once
+#include "pickscheduler.h"
+
+// Choose work-group sizes for the device
+#include "picktuner.h"
+
+// Time the stages of each pick
+#include "pickprofiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
 #include <climits>
+#include <cstring>
 #include <cstdlib>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
+
+// Picking strategies selected with the 'm' key
+enum PickMode {
+  PICK_OBJECTS,     // One kernel launch per object
+  PICK_SCENE,       // One kernel launch over the concatenated scene
+  PICK_VECTOR,      // Scene launch testing packets of triangles per lane
+  PICK_ATOMIC,      // Scene launch that atomically updates one result
+  PICK_BVH,         // One work-item traversing the scene BVH
+  PICK_MULTI,       // Scene split across every OpenCL device
+  PICK_CPU,         // CPU BVH traversal in the pick engine
+  NUM_PICK_MODES
+};
+const char* pick_mode_names[NUM_PICK_MODES] = {"per-object", "scene", "vector", 
+                                               "atomic", "BVH", "multi-device", 
+                                               "CPU"};
+const char* pick_cull_names[] = {"none", "back faces", "front faces"};
+
+// Pick-through modes cycled with the 't' key. Clicking the same pixel
+// again selects the next object along the ray.
+enum ThroughMode {
+  THROUGH_OFF,
+  THROUGH_ALL,      // Every hit along the ray
+  THROUGH_NEAREST   // The NEAREST_HITS nearest hits of each work-group
+};
+const char* through_mode_names[] = {"off", "all hits", "nearest hits"};
 
 struct LightParameters {
   glm::vec4 diffuse_intensity;
@@ -61,17 +133,174 @@ float half_height, half_width;    // Window dimensions divided in half
 unsigned num_objects;             // Number of meshes in the vector
 unsigned int 
    selected_object = UINT_MAX;    // Object selected by user
+std::vector<unsigned char> 
+   selected_set;                  // SelectState of each object, or empty
+unsigned int 
+   hovered_object = UINT_MAX;     // Object under the pointer in hover mode
+PickEngine pick_engine;           // Scene data and CPU picking
+PickResult pick_result;           // Details of the most recent pick
+PickScheduler pick_scheduler;     // Devices used by multi-device picks
 size_t num_triangles;             // Number of triangles in the rendering
+PickMode pick_mode = PICK_OBJECTS; // Current picking strategy
+PickCull pick_cull = PICK_CULL_BACK; // Faces ignored, cycled with 'c'
+float pick_epsilon = PICK_RELATIVE_EPSILON; // Tolerance per unit of scene size
+PickProfiler pick_profiler;       // Enabled by the PICK_PROFILE variable
 
 // OpenCL variables
 cl_platform_id platform;
 cl_device_id device;
+bool zero_copy = false;             // CPU device using host arrays in place
+cl_mem_flags input_flags;           // How buffers take their initial data
+cl_mem_flags output_flags;          // Extra flags of buffers read by the host
 cl_context context;
 cl_program program;
+std::string program_options;        // Build options of PROGRAM_FILE
 cl_command_queue queue;
 cl_kernel kernel;
-cl_mem vbo_memobj, ibo_memobj, t_out_buffer;
-size_t max_group_size;
+cl_mem *vbo_memobjs, *ibo_memobjs;  // Memory objects shared with VBOs/IBOs
+cl_mem *t_out_buffers;              // Per-group distances for each geometry
+cl_mem *id_out_buffers;             // Per-group triangles for each geometry
+size_t max_group_size;             // Shared with the precomputed kernel
+
+// OpenCL variables for precomputed triangles
+cl_kernel precomputed_kernel;
+cl_mem *precomputed_buffers;        // M, E and F of each object, or NULL
+cl_ulong precompute_budget;         // Device memory allowed for them
+
+// Per-object kernels built for one class of meshes, with the triangle
+// count, index type and vertex stride fixed at compile time
+struct KernelVariant {
+  cl_program program;
+  cl_kernel kernel;                 // Specialized KERNEL_FUNC
+  cl_kernel precomputed_kernel;     // Specialized PRECOMPUTED_KERNEL_FUNC
+};
+
+// OpenCL variables for kernel variants
+std::map<std::string, KernelVariant> 
+   kernel_variants;                 // Keyed by build options
+KernelVariant** object_variants;    // Variant of each object, or NULL
+
+// OpenCL variables for the second-stage reduction
+cl_kernel reduce_kernel;
+cl_mem t_result_buffer;             // Smallest distance for each geometry
+cl_mem id_result_buffer;            // Triangle or object of each distance
+float *t_result;                    // Host array for distance results
+cl_uint *id_result;                 // Host array for id results
+size_t reduce_group_size;
+
+// Triangles tested by each work-item of the per-object, scene and
+// atomic kernels, set with their group sizes by the autotuner
+cl_uint tris_per_item = 1;
+
+// OpenCL variables for scene-wide picking
+cl_kernel scene_kernel;
+cl_mem scene_vbo, scene_ibo;        // Concatenated vertices and indices
+cl_mem scene_t_out, scene_id_out;   // Per-group distances and triangles
+cl_uint num_scene_triangles;        // Number of triangles in the scene
+size_t scene_group_size;
+
+// OpenCL variables for vector picking
+cl_kernel vector_kernel;
+cl_mem vector_packets;              // Triangles in SoA packets
+cl_uint num_packets;                // Number of packets in the scene
+cl_uint vec_width;                  // Triangles per packet, PICK_VEC_WIDTH
+size_t vector_group_size;
+
+// OpenCL variables for BVH picking
+cl_kernel bvh_kernel;
+cl_mem bvh_nodes, bvh_order;        // Flattened BVH and its triangle order
+
+// OpenCL variables for batched picking
+cl_kernel batch_kernel;
+cl_mem batch_rays;                  // Origin and direction of each ray
+cl_mem batch_t, batch_id;           // Distance and triangle of each ray
+size_t batch_capacity = 0;          // Number of rays the buffers can hold
+size_t batch_group_size;
+
+// OpenCL variables for atomic picking
+cl_kernel atomic_kernel;            // NULL if 64-bit atomics are missing
+cl_mem atomic_result;               // Packed distance and triangle
+size_t atomic_group_size;
+cl_ulong atomic_key;                // Host copy of the packed result
+
+// OpenCL variables for pick-through
+cl_kernel all_hits_kernel, nearest_kernel, sort_kernel;
+cl_mem hit_t, hit_id;               // Hits along the ray, MAX_HITS at most
+cl_mem hit_count;                   // Number of hits, which may exceed MAX_HITS
+size_t all_hits_group_size, nearest_group_size, sort_group_size;
+ThroughMode through_mode = THROUGH_OFF;
+std::vector<PickResult> through_hits; // Nearest hit on each object, nearest first
+unsigned int through_index;         // Object of through_hits selected last
+int through_x = -1, through_y = -1; // Pixel of the last pick-through click
+
+// OpenCL variables for box selection
+cl_kernel select_objects_kernel, select_triangles_kernel;
+cl_mem frustum_buffer;              // Planes and corners of the selected volume
+cl_mem object_boxes;                // Bounding box of each object
+cl_mem triangle_objects;            // Object of each scene triangle
+cl_mem object_state;                // SelectState of each object
+size_t select_objects_group_size, select_triangles_group_size;
+bool marquee_active = false;        // Whether the right button is dragging
+int marquee_x, marquee_y;           // Pixel where the drag started
+
+// OpenCL variables for lasso selection
+cl_kernel lasso_kernel;
+cl_mem lasso_polygon;               // Lasso points in device coordinates
+cl_mem vertex_objects;              // Object of each scene vertex
+cl_uint num_scene_vertices;
+size_t lasso_group_size;
+bool lasso_active = false;          // Whether the middle button is dragging
+std::vector<glm::vec2> lasso_points; // Window pixels along the lasso
+
+// Creates an OpenCL event from an OpenGL fence (cl_khr_gl_event)
+typedef cl_event (*create_event_from_glsync_fn)(cl_context, cl_GLsync, cl_int*);
+
+// Pick whose commands have been enqueued but whose result hasn't been
+// delivered yet
+struct PendingPick {
+  PickMode mode;
+  glm::vec4 origin, dir;
+  double submit_time;                 // Wall-clock time of the request
+  std::vector<ObjectEntry> entries;   // Objects launched in per-object mode
+  GLsync sync;                        // Fence the pick waits on, or 0
+  float* t_data;                      // Where the results appear once read
+  cl_uint* id_data;
+  cl_ulong* key_data;
+  void (*callback)(const PickResult&);
+};
+
+// OpenCL variables for asynchronous picking
+create_event_from_glsync_fn 
+   create_event_from_glsync = NULL; // NULL if cl_khr_gl_event is missing
+std::deque<PendingPick> pending_picks; // The front pick is on the queue
+cl_event pick_event;                // Last command of the front pick
+std::atomic<unsigned int> 
+   picks_completed(0);              // Incremented by the event callback
+unsigned int picks_delivered = 0;   // Picks handed to their callbacks
+bool poll_scheduled = false;        // Whether the poll timer is running
+bool async_picking = true;          // Toggled with the 'a' key
+
+// Hover picking. Motion events are coalesced into hover_request, so at
+// most one hover pick is in flight and only the newest event is picked.
+struct HoverRequest {
+  glm::vec4 origin, dir;
+  double time;                      // Wall-clock time of the motion event
+};
+bool hover_picking = false;         // Toggled with the 'h' key
+HoverRequest hover_request;         // Newest motion event not yet picked
+bool hover_waiting = false;         // Whether hover_request awaits a pick
+bool hover_in_flight = false;       // Whether a hover pick is queued
+bool hover_timer_set = false;       // Whether a rate-limited pick is scheduled
+double hover_last_submit = 0.0;     // When the last hover pick was issued
+double hover_event_time;            // Event time of the last issued pick
+unsigned long hover_events = 0;     // Motion events received
+unsigned long hover_dropped = 0;    // Events replaced before being picked
+
+// CPU and multi-device hover picks run on hover_thread, which stores its
+// result and sets hover_done for the GLUT loop to poll
+std::thread hover_thread;
+PickResult hover_result;            // Written by hover_thread
+std::atomic<bool> hover_done(false);
 
 // Read a character buffer from a file
 std::string read_file(const char* filename) {
@@ -242,13 +471,98 @@ void init_uniforms(GLuint program) {
   glUseProgram(program);
 }
 
+// Build options of the kernel variant for object i
+std::string variant_options(const std::string& options, unsigned int i) {
+
+  std::string variant = options;
+
+  variant += " -DPICK_TRIANGLES=" + std::to_string(geom_vec[i].index_count/3);
+  variant += " -DPICK_VERTEX_STRIDE=" + std::to_string(geom_vec[i].map["POSITION"].stride);
+  // The watertight test relies on exact signs, which relaxed math breaks
+  if(getenv("PICK_FAST_MATH") != NULL && !pick_engine.isWatertight()) {
+    variant += " -cl-fast-relaxed-math -cl-mad-enable";
+  }
+  return variant;
+}
+
+// Build specialized per-object kernels for the mesh classes holding the
+// most triangles, at most MAX_KERNEL_VARIANTS of them. The other objects
+// keep the generic kernels.
+void init_kernel_variants(const std::string& options) {
+
+  std::map<std::string, size_t> class_triangles;
+  std::vector<std::pair<size_t, std::string> > classes;
+  std::string source = read_file(PROGRAM_FILE), key;
+  size_t group_size;
+  int err;
+
+  // Total the triangles of each class
+  for(unsigned int i=0; i<num_objects; i++) {
+    class_triangles[variant_options(options, i)] += geom_vec[i].index_count/3;
+  }
+  for(std::map<std::string, size_t>::iterator it = class_triangles.begin(); 
+      it != class_triangles.end(); it++) {
+    classes.push_back(std::make_pair(it->second, it->first));
+  }
+  std::sort(classes.rbegin(), classes.rend());
+  if(classes.size() > MAX_KERNEL_VARIANTS) {
+    classes.resize(MAX_KERNEL_VARIANTS);
+  }
+
+  // Build each variant, reusing its binary from the program cache
+  for(size_t i=0; i<classes.size(); i++) {
+    KernelVariant& variant = kernel_variants[classes[i].second];
+    variant.program = ProgramCache::build(context, device, source, 
+                                          classes[i].second.c_str());
+    variant.kernel = clCreateKernel(variant.program, KERNEL_FUNC, &err);
+    if(err == CL_SUCCESS) {
+      variant.precomputed_kernel = clCreateKernel(variant.program, 
+                                                  PRECOMPUTED_KERNEL_FUNC, &err);
+    }
+    if(err < 0) {
+      std::cerr << "Couldn't create a kernel: " << err << std::endl;
+      exit(1);
+    };
+
+    // Keep the per-object group size valid for the variant
+    clGetKernelWorkGroupInfo(variant.kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                             sizeof(group_size), &group_size, NULL);
+    max_group_size = std::min(max_group_size, group_size);
+    clGetKernelWorkGroupInfo(variant.precomputed_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                             sizeof(group_size), &group_size, NULL);
+    max_group_size = std::min(max_group_size, group_size);
+  }
+
+  // Point each object at its variant
+  object_variants = new KernelVariant*[num_objects];
+  for(unsigned int i=0; i<num_objects; i++) {
+    key = variant_options(options, i);
+    object_variants[i] = kernel_variants.count(key) ? &kernel_variants[key] : NULL;
+  }
+}
+
+// Release the kernels and programs of the variants
+void release_kernel_variants() {
+
+  for(std::map<std::string, KernelVariant>::iterator it = kernel_variants.begin(); 
+      it != kernel_variants.end(); it++) {
+    clReleaseKernel(it->second.precomputed_kernel);
+    clReleaseKernel(it->second.kernel);
+    clReleaseProgram(it->second.program);
+  }
+  kernel_variants.clear();
+  delete[] object_variants;
+}
+
 // Initialize OpenCL processing 
 void init_cl() {
 
-  std::string program_string;
-  const char *program_chars;
-  char *program_log;
-  size_t program_size, log_size;
+  std::ostringstream miss_stream;
+  char *extensions;
+  size_t ext_size, group_size;
+  cl_device_type device_type;
+  cl_uint preferred_width;
+  cl_ulong local_mem_size;
   int err;
 
   // Identify a platform
@@ -268,48 +582,56 @@ void init_cl() {
       exit(1);   
    }
 
+  // CPU devices work on the host arrays directly, without OpenGL sharing
+  clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(device_type), &device_type, NULL);
+  zero_copy = (device_type & CL_DEVICE_TYPE_CPU) != 0;
+  input_flags = zero_copy ? CL_MEM_ALLOC_HOST_PTR | CL_MEM_COPY_HOST_PTR : 
+                            CL_MEM_COPY_HOST_PTR;
+  output_flags = zero_copy ? CL_MEM_ALLOC_HOST_PTR : 0;
+
   // Create OpenCL context properties 
   cl_context_properties properties[] = {
     CL_GL_CONTEXT_KHR, (cl_context_properties)glXGetCurrentContext(), 
     CL_GLX_DISPLAY_KHR, (cl_context_properties)glXGetCurrentDisplay(), 
     CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0};
+  cl_context_properties cpu_properties[] = {
+    CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0};
 
   // Create context 
-  context = clCreateContext(properties, 1, &device, NULL, NULL, &err);
+  context = clCreateContext(zero_copy ? cpu_properties : properties, 
+                            1, &device, NULL, NULL, &err);
   if(err < 0) {
     std::cerr << "Couldn't create a context" << std::endl;
     exit(1);   
   }
 
-  // Create program from file 
-  program_string = read_file(PROGRAM_FILE);
-  program_chars = program_string.c_str();
-  program_size = program_string.size();
-  program = clCreateProgramWithSource(context, 1, &program_chars, 
-                                      &program_size, &err);
-  if(err < 0) {
-    std::cerr << "Couldn't create the program" << std::endl;
-    exit(1);
-  }
+  // Pack eight triangles per vector on devices with wide float vectors
+  clGetDeviceInfo(device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, 
+                  sizeof(preferred_width), &preferred_width, NULL);
+  vec_width = (preferred_width >= 8) ? 8 : 4;
+  program_options = "-DPICK_VEC_WIDTH=" + std::to_string(vec_width);
 
-  // Build program 
-  err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-  if(err < 0) {
+  // Size the per-group hit lists of the nearest-hits kernel
+  program_options += " -DPICK_K=" + std::to_string(NEAREST_HITS);
 
-    // Find size of log and print to std output 
-    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 
-                          0, NULL, &log_size);
-    program_log = new char(log_size + 1);
-    program_log[log_size] = '\0';
-    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 
-                          log_size + 1, (void*)program_log, NULL);
-    std::cout << program_log << std::endl;
-    delete(program_log);
-    exit(1);
+  // Report misses as the pick engine does, exactly, as a hexadecimal float
+  miss_stream << std::hexfloat << PICK_MISS << "f";
+  program_options += " -DPICK_MISS=" + miss_stream.str();
+
+  // Test triangles the same way as the pick engine
+  if(pick_engine.isWatertight()) {
+    program_options += " -DPICK_WATERTIGHT";
   }
 
-  // Create a command queue 
-  queue = clCreateCommandQueue(context, device, 0, &err);
+  // Create program from file, or from its cached binary
+  program = ProgramCache::build(context, device, read_file(PROGRAM_FILE), 
+                                program_options.c_str());
+
+  // Create a command queue, timing its commands in instrumented mode
+  pick_profiler.setEnabled(getenv("PICK_PROFILE") != NULL);
+  queue = clCreateCommandQueue(context, device, 
+                               pick_profiler.enabled() ? CL_QUEUE_PROFILING_ENABLE : 0, 
+                               &err);
   if(err < 0) {
     std::cerr << "Couldn't create a command queue" << std::endl;
     exit(1);   
@@ -322,9 +644,523 @@ void init_cl() {
     exit(1);
   };
 
+  // Create scene kernel
+  scene_kernel = clCreateKernel(program, SCENE_KERNEL_FUNC, &err);
+  if(err < 0) {
+    std::cerr << "Couldn't create a kernel: " << err << std::endl;
+    exit(1);
+  };
+
+  // Create precomputed-triangle kernel
+  precomputed_kernel = clCreateKernel(program, PRECOMPUTED_KERNEL_FUNC, &err);
+  if(err < 0) {
+    std::cerr << "Couldn't create a kernel: " << err << std::endl;
+    exit(1);
+  };
+
+  // Create vector kernel
+  vector_kernel = clCreateKernel(program, VECTOR_KERNEL_FUNC, &err);
+  if(err < 0) {
+    std::cerr << "Couldn't create a kernel: " << err << std::endl;
+    exit(1);
+  };
+
+  // Create BVH kernel
+  bvh_kernel = clCreateKernel(program, BVH_KERNEL_FUNC, &err);
+  if(err < 0) {
+    std::cerr << "Couldn't create a kernel: " << err << std::endl;
+    exit(1);
+  };
+
+  // Create batch kernel
+  batch_kernel = clCreateKernel(program, BATCH_KERNEL_FUNC, &err);
+  if(err < 0) {
+    std::cerr << "Couldn't create a kernel: " << err << std::endl;
+    exit(1);
+  };
+
+  // Create pick-through kernels
+  all_hits_kernel = clCreateKernel(program, ALL_HITS_KERNEL_FUNC, &err);
+  if(err == CL_SUCCESS) {
+    nearest_kernel = clCreateKernel(program, NEAREST_KERNEL_FUNC, &err);
+  }
+  if(err == CL_SUCCESS) {
+    sort_kernel = clCreateKernel(program, SORT_KERNEL_FUNC, &err);
+  }
+  if(err < 0) {
+    std::cerr << "Couldn't create a kernel: " << err << std::endl;
+    exit(1);
+  };
+
+  // Create box selection kernels
+  select_objects_kernel = clCreateKernel(program, SELECT_OBJECTS_KERNEL_FUNC, &err);
+  if(err == CL_SUCCESS) {
+    select_triangles_kernel = clCreateKernel(program, SELECT_TRIANGLES_KERNEL_FUNC, &err);
+  }
+  if(err == CL_SUCCESS) {
+    lasso_kernel = clCreateKernel(program, LASSO_KERNEL_FUNC, &err);
+  }
+  if(err < 0) {
+    std::cerr << "Couldn't create a kernel: " << err << std::endl;
+    exit(1);
+  };
+
+  // Create reduction kernel
+  reduce_kernel = clCreateKernel(program, REDUCE_KERNEL_FUNC, &err);
+  if(err < 0) {
+    std::cerr << "Couldn't create a kernel: " << err << std::endl;
+    exit(1);
+  };
+
+  // Create atomic kernel if the device supports 64-bit atomic min
+  clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, NULL, &ext_size);
+  extensions = new char[ext_size + 1];
+  extensions[ext_size] = '\0';
+  clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, ext_size, extensions, NULL);
+  atomic_kernel = NULL;
+  if(strstr(extensions, ATOMICS_EXTENSION) != NULL) {
+    atomic_kernel = clCreateKernel(program, ATOMIC_KERNEL_FUNC, &err);
+    if(err < 0) {
+      std::cerr << "Couldn't create a kernel: " << err << std::endl;
+      exit(1);
+    };
+    clGetKernelWorkGroupInfo(atomic_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                             sizeof(atomic_group_size), &atomic_group_size, NULL);
+  }
+
+  // Let the OpenGL fence replace glFinish if the device supports it
+  if(!zero_copy && strstr(extensions, GL_EVENT_EXTENSION) != NULL) {
+    create_event_from_glsync = (create_event_from_glsync_fn)
+      clGetExtensionFunctionAddressForPlatform(platform, "clCreateEventFromGLsyncKHR");
+  }
+  delete[] extensions;
+
+  // Allow precomputed triangles a quarter of the device memory, or
+  // PICK_PRECOMPUTE_MB megabytes if set
+  clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, 
+                  sizeof(precompute_budget), &precompute_budget, NULL);
+  precompute_budget /= 4;
+  if(getenv("PICK_PRECOMPUTE_MB") != NULL) {
+    precompute_budget = (cl_ulong)atol(getenv("PICK_PRECOMPUTE_MB")) << 20;
+  }
+
+  // Vertices rebuilt from precomputed edges aren't exact, which would
+  // reopen the cracks the watertight test closes
+  if(pick_engine.isWatertight()) {
+    precompute_budget = 0;
+  }
+
   // Determine maximum size of work groups
   clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
                            sizeof(max_group_size), &max_group_size, NULL);
+  clGetKernelWorkGroupInfo(precomputed_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                           sizeof(group_size), &group_size, NULL);
+  max_group_size = std::min(max_group_size, group_size);
+  clGetKernelWorkGroupInfo(scene_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                           sizeof(scene_group_size), &scene_group_size, NULL);
+  clGetKernelWorkGroupInfo(reduce_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                           sizeof(reduce_group_size), &reduce_group_size, NULL);
+  clGetKernelWorkGroupInfo(batch_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                           sizeof(batch_group_size), &batch_group_size, NULL);
+  clGetKernelWorkGroupInfo(vector_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                           sizeof(vector_group_size), &vector_group_size, NULL);
+  clGetKernelWorkGroupInfo(all_hits_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                           sizeof(all_hits_group_size), &all_hits_group_size, NULL);
+  clGetKernelWorkGroupInfo(sort_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                           sizeof(sort_group_size), &sort_group_size, NULL);
+  sort_group_size = std::min(sort_group_size, (size_t)MAX_HITS/2);
+  clGetKernelWorkGroupInfo(select_objects_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                           sizeof(select_objects_group_size), 
+                           &select_objects_group_size, NULL);
+  clGetKernelWorkGroupInfo(select_triangles_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                           sizeof(select_triangles_group_size), 
+                           &select_triangles_group_size, NULL);
+  clGetKernelWorkGroupInfo(lasso_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                           sizeof(lasso_group_size), &lasso_group_size, NULL);
+
+  // Each work-item of the nearest-hits kernel keeps NEAREST_HITS entries
+  // in local memory
+  clGetKernelWorkGroupInfo(nearest_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                           sizeof(nearest_group_size), &nearest_group_size, NULL);
+  clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem_size), 
+                  &local_mem_size, NULL);
+  nearest_group_size = std::min(nearest_group_size, (size_t)(local_mem_size / 
+                       (NEAREST_HITS * (sizeof(float) + sizeof(cl_uint)))));
+
+  init_kernel_variants(program_options);
+}
+
+// Number of work-groups that cover num_triangles triangles
+size_t group_count(cl_uint num_triangles, size_t group_size) {
+  size_t per_group = group_size * tris_per_item;
+  return (num_triangles + per_group - 1)/per_group;
+}
+
+// Create a read-only buffer initialized with size bytes of host data. The
+// engine's vectors could be wrapped with CL_MEM_USE_HOST_PTR, but runtimes
+// may copy unaligned host memory behind the scenes, so on CPU devices
+// input_flags copy them once into memory the runtime allocates, which
+// kernels then use in place. OpenCL rejects empty buffers, so an empty
+// array gets an uninitialized placeholder that no kernel reads.
+cl_mem create_input_buffer(const void* data, size_t size, cl_mem_flags flags, 
+                           cl_int* err) {
+  if(size == 0) {
+    return clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_uint), NULL, err);
+  }
+  return clCreateBuffer(context, CL_MEM_READ_ONLY | flags, size, (void*)data, err);
+}
+
+// Create buffers from the scene-wide vertex and index arrays of the engine
+void init_scene_buffers() {
+
+  const std::vector<float>& positions = pick_engine.positions();
+  const std::vector<unsigned int>& indices = pick_engine.indices();
+  size_t num_groups;
+  int err;
+
+  std::vector<float> packets, boxes;
+  std::vector<cl_uint> tri_objects, vert_objects;
+
+  num_scene_triangles = pick_engine.triangleCount();
+  num_scene_vertices = positions.size()/3;
+  pick_engine.packTriangles(vec_width, &packets);
+  num_packets = packets.size()/(9 * vec_width);
+
+  // Create the slot for atomic results
+  atomic_result = clCreateBuffer(context, CL_MEM_READ_WRITE | output_flags, 
+                                 sizeof(cl_ulong), NULL, &err);
+  if(err < 0) {
+    std::cerr << "Couldn't create a buffer object" << std::endl;
+    exit(1);
+  }
+
+  // Create the pick-through hit lists
+  hit_t = clCreateBuffer(context, CL_MEM_READ_WRITE | output_flags, 
+                         MAX_HITS * sizeof(float), NULL, &err);
+  if(err == CL_SUCCESS) {
+    hit_id = clCreateBuffer(context, CL_MEM_READ_WRITE | output_flags, 
+                            MAX_HITS * sizeof(cl_uint), NULL, &err);
+  }
+  if(err == CL_SUCCESS) {
+    hit_count = clCreateBuffer(context, CL_MEM_READ_WRITE | output_flags, 
+                               sizeof(cl_uint), NULL, &err);
+  }
+  if(err < 0) {
+    std::cerr << "Couldn't create a buffer object" << std::endl;
+    exit(1);
+  }
+
+  // The scene and vector kernels share the per-group result buffers
+  num_groups = std::max(group_count(num_scene_triangles, scene_group_size), 
+                        group_count(num_packets, vector_group_size));
+  num_groups = std::max(num_groups, (size_t)1);
+
+  // Create buffer objects for the scene data
+  scene_vbo = create_input_buffer(positions.data(), positions.size() * sizeof(float), 
+                                  input_flags, &err);
+  if(err == CL_SUCCESS) {
+    scene_ibo = create_input_buffer(indices.data(), indices.size() * sizeof(cl_uint), 
+                                    input_flags, &err);
+  }
+  if(err < 0) {
+    std::cerr << "Couldn't create a scene buffer object" << std::endl;
+    exit(1);
+  }
+
+  // Create buffer objects for box selection
+  for(unsigned int i=0; i<num_objects; i++) {
+    const ObjectBounds& bounds = pick_engine.bounds()[i];
+    boxes.insert(boxes.end(), &bounds.min[0], &bounds.min[0] + 3);
+    boxes.insert(boxes.end(), &bounds.max[0], &bounds.max[0] + 3);
+  }
+  for(cl_uint i=0; i<num_scene_triangles; i++) {
+    tri_objects.push_back(pick_engine.triangleObject(i));
+  }
+  object_boxes = create_input_buffer(boxes.data(), boxes.size() * sizeof(float), 
+                                     CL_MEM_COPY_HOST_PTR, &err);
+  if(err == CL_SUCCESS) {
+    triangle_objects = create_input_buffer(tri_objects.data(), 
+                                           tri_objects.size() * sizeof(cl_uint), 
+                                           CL_MEM_COPY_HOST_PTR, &err);
+  }
+  if(err == CL_SUCCESS) {
+    object_state = clCreateBuffer(context, CL_MEM_READ_WRITE | output_flags, 
+                                  std::max(num_objects, 1u) * sizeof(cl_uchar), NULL, &err);
+  }
+  if(err == CL_SUCCESS) {
+    frustum_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, 
+                                    14 * 4 * sizeof(float), NULL, &err);
+  }
+  if(err < 0) {
+    std::cerr << "Couldn't create a selection buffer object" << std::endl;
+    exit(1);
+  }
+
+  // Create buffer objects for lasso selection
+  for(unsigned int i=0; i<num_objects; i++) {
+    vert_objects.resize((i + 1 < num_objects) ? 
+                        pick_engine.firstVertices()[i+1] : num_scene_vertices, i);
+  }
+  vertex_objects = create_input_buffer(vert_objects.data(), 
+                                       vert_objects.size() * sizeof(cl_uint), 
+                                       CL_MEM_COPY_HOST_PTR, &err);
+  if(err == CL_SUCCESS) {
+    lasso_polygon = clCreateBuffer(context, CL_MEM_READ_ONLY, 
+                                   MAX_LASSO_POINTS * 2 * sizeof(float), NULL, &err);
+  }
+  if(err < 0) {
+    std::cerr << "Couldn't create a selection buffer object" << std::endl;
+    exit(1);
+  }
+
+  // Create buffer object for the triangle packets
+  vector_packets = create_input_buffer(packets.data(), packets.size() * sizeof(float), 
+                                       CL_MEM_COPY_HOST_PTR, &err);
+  if(err < 0) {
+    std::cerr << "Couldn't create a packet buffer object" << std::endl;
+    exit(1);
+  }
+
+  // Create buffer objects for the BVH
+  const PickBVH& bvh = pick_engine.bvh();
+  bvh_nodes = create_input_buffer(bvh.nodes().data(), 
+                                  bvh.nodes().size() * sizeof(BVHNode), 
+                                  input_flags, &err);
+  if(err == CL_SUCCESS) {
+    bvh_order = create_input_buffer(bvh.triangleOrder().data(), 
+                                    bvh.triangleOrder().size() * sizeof(cl_uint), 
+                                    input_flags, &err);
+  }
+  if(err < 0) {
+    std::cerr << "Couldn't create a BVH buffer object" << std::endl;
+    exit(1);
+  }
+
+  // Create buffer objects for the results
+  scene_t_out = clCreateBuffer(context, CL_MEM_READ_WRITE, 
+                               num_groups * sizeof(float), NULL, &err);
+  if(err == CL_SUCCESS) {
+    scene_id_out = clCreateBuffer(context, CL_MEM_READ_WRITE, 
+                                  num_groups * sizeof(cl_uint), NULL, &err);
+  }
+  if(err < 0) {
+    std::cerr << "Couldn't create a buffer object" << std::endl;
+    exit(1);
+  }
+}
+
+// Release the scene-wide buffers
+void release_scene_buffers() {
+  clReleaseMemObject(scene_vbo);
+  clReleaseMemObject(scene_ibo);
+  clReleaseMemObject(scene_t_out);
+  clReleaseMemObject(scene_id_out);
+  clReleaseMemObject(atomic_result);
+  clReleaseMemObject(hit_t);
+  clReleaseMemObject(hit_id);
+  clReleaseMemObject(hit_count);
+  clReleaseMemObject(object_boxes);
+  clReleaseMemObject(triangle_objects);
+  clReleaseMemObject(object_state);
+  clReleaseMemObject(frustum_buffer);
+  clReleaseMemObject(vertex_objects);
+  clReleaseMemObject(lasso_polygon);
+  clReleaseMemObject(bvh_nodes);
+  clReleaseMemObject(bvh_order);
+  clReleaseMemObject(vector_packets);
+}
+
+// Release the batch buffers
+void release_batch_buffers() {
+  if(batch_capacity > 0) {
+    clReleaseMemObject(batch_rays);
+    clReleaseMemObject(batch_t);
+    clReleaseMemObject(batch_id);
+    batch_capacity = 0;
+  }
+}
+
+// Make sure the batch buffers can hold num_rays rays, doubling their size
+// when they grow so repeated batches don't reallocate
+void reserve_batch_buffers(size_t num_rays) {
+
+  int err;
+
+  if(num_rays <= batch_capacity) {
+    return;
+  }
+  release_batch_buffers();
+  batch_capacity = std::max(num_rays, 2 * batch_capacity);
+  batch_rays = clCreateBuffer(context, CL_MEM_READ_ONLY, 
+                              2 * batch_capacity * sizeof(cl_float4), NULL, &err);
+  if(err == CL_SUCCESS) {
+    batch_t = clCreateBuffer(context, CL_MEM_WRITE_ONLY | output_flags, 
+                             batch_capacity * sizeof(float), NULL, &err);
+  }
+  if(err == CL_SUCCESS) {
+    batch_id = clCreateBuffer(context, CL_MEM_WRITE_ONLY | output_flags, 
+                              batch_capacity * sizeof(cl_uint), NULL, &err);
+  }
+  if(err < 0) {
+    std::cerr << "Couldn't create a batch buffer object" << std::endl;
+    exit(1);
+  }
+}
+
+// Store the triangles of the largest meshes as vertex and edges, as long
+// as they fit in the budget. The other meshes use the indexed kernel.
+void init_precomputed_buffers() {
+
+  std::vector<std::pair<unsigned int, unsigned int> > sizes; // Triangles, object
+  std::vector<float> tris;
+  cl_ulong used = 0, size;
+  unsigned int i;
+  int err;
+
+  precomputed_buffers = new cl_mem[num_objects];
+  for(i=0; i<num_objects; i++) {
+    precomputed_buffers[i] = NULL;
+    sizes.push_back(std::make_pair(geom_vec[i].index_count/3, i));
+  }
+  std::sort(sizes.rbegin(), sizes.rend());
+
+  for(size_t j=0; j<sizes.size(); j++) {
+    i = sizes[j].second;
+    size = 9 * (geom_vec[i].index_count/3) * sizeof(float);
+    if(size == 0 || used + size > precompute_budget) {
+      continue;
+    }
+    pick_engine.precomputeTriangles(i, &tris);
+    precomputed_buffers[i] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
+                                            size, (void*)&tris[0], &err);
+    if(err < 0) {
+      std::cerr << "Couldn't create a precomputed buffer object" << std::endl;
+      exit(1);
+    }
+    used += size;
+  }
+}
+
+// Release the precomputed triangles
+void release_precomputed_buffers() {
+  for(unsigned int i=0; i<num_objects; i++) {
+    if(precomputed_buffers[i] != NULL) {
+      clReleaseMemObject(precomputed_buffers[i]);
+    }
+  }
+  delete[] precomputed_buffers;
+}
+
+// Create OpenCL memory objects for every geometry
+void init_cl_buffers() {
+
+  double start = PickProfiler::now();
+  size_t num_groups;
+  int err;
+
+  vbo_memobjs = new cl_mem[num_objects];
+  ibo_memobjs = new cl_mem[num_objects];
+  t_out_buffers = new cl_mem[num_objects];
+  id_out_buffers = new cl_mem[num_objects];
+
+  for(unsigned int i=0; i<num_objects; i++) {
+
+    // Wrap the mesh's own arrays on CPU devices
+    if(zero_copy) {
+      SourceData& pos = geom_vec[i].map["POSITION"];
+      vbo_memobjs[i] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, 
+                                      pos.size, pos.data, &err);
+      if(err == CL_SUCCESS) {
+        ibo_memobjs[i] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, 
+                                        geom_vec[i].index_count * sizeof(unsigned short), 
+                                        geom_vec[i].indices, &err);
+      }
+      if(err < 0) {
+        std::cerr << "Couldn't create a buffer object from host data" << std::endl;
+        exit(1);
+      }
+    }
+    else {
+
+      // Create memory object from VBO
+      vbo_memobjs[i] = clCreateFromGLBuffer(context, CL_MEM_READ_ONLY, vbos[2*i], &err);
+      if(err < 0) {
+        std::cerr << "Couldn't create a buffer object from a VBO" << std::endl;
+        exit(1);
+      }
+
+      // Create memory object from IBO
+      ibo_memobjs[i] = clCreateFromGLBuffer(context, CL_MEM_READ_ONLY, ibos[i], &err);
+      if(err < 0) {
+        std::cerr << "Couldn't create a buffer object from an IBO" << std::endl;
+        exit(1);
+      }
+    }
+
+    // Create buffer objects for the per-group distances and triangles
+    num_groups = std::max(group_count(geom_vec[i].index_count/3, max_group_size), 
+                          (size_t)1);
+    t_out_buffers[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, 
+                                      num_groups * sizeof(float), NULL, &err);
+    if(err == CL_SUCCESS) {
+      id_out_buffers[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, 
+                                         num_groups * sizeof(cl_uint), NULL, &err);
+    }
+    if(err < 0) {
+      std::cerr << "Couldn't create a buffer object" << std::endl;
+      exit(1);
+    }
+  }
+
+  init_precomputed_buffers();
+
+  // Create buffer objects holding one reduced result per geometry
+  t_result_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY | output_flags, 
+                                   std::max(num_objects, 1u) * sizeof(float), NULL, &err);
+  if(err == CL_SUCCESS) {
+    id_result_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY | output_flags, 
+                                      std::max(num_objects, 1u) * sizeof(cl_uint), NULL, &err);
+  }
+  if(err < 0) {
+    std::cerr << "Couldn't create a buffer object" << std::endl;
+    exit(1);
+  }
+  t_result = new float[num_objects];
+  id_result = new cl_uint[num_objects];
+
+  init_scene_buffers();
+  pick_profiler.record("buffer creation", PickProfiler::now() - start);
+}
+
+// Release the OpenCL memory objects
+void release_cl_buffers() {
+
+  for(unsigned int i=0; i<num_objects; i++) {
+    clReleaseMemObject(vbo_memobjs[i]);
+    clReleaseMemObject(ibo_memobjs[i]);
+    clReleaseMemObject(t_out_buffers[i]);
+    clReleaseMemObject(id_out_buffers[i]);
+  }
+  delete[] vbo_memobjs;
+  delete[] ibo_memobjs;
+  delete[] t_out_buffers;
+  delete[] id_out_buffers;
+  release_precomputed_buffers();
+
+  clReleaseMemObject(t_result_buffer);
+  clReleaseMemObject(id_result_buffer);
+  delete[] t_result;
+  delete[] id_result;
+
+  release_scene_buffers();
+  release_batch_buffers();
+}
+
+// Recreate the OpenCL memory objects after the geometry changes
+void update_cl_buffers() {
+  clFinish(queue);
+  release_cl_buffers();
+  init_cl_buffers();
 }
 
 // Initialize the OpenGL Rendering
@@ -360,7 +1196,13 @@ void display(void) {
   // Draw elements of each mesh in the vector
   for(unsigned int i=0; i<num_objects; i++) {
     glBindVertexArray(vaos[i]);
-    if(i != selected_object) {
+    if(i == hovered_object && i != selected_object && 
+       (selected_set.empty() || selected_set[i] != SELECT_IN)) {
+       glm::vec3 hover_color = (colors[i] + white) * 0.5f;
+       glUniform3fv(color_location, 1, &(hover_color[0])); 
+    }
+    else if(i != selected_object && 
+       (selected_set.empty() || selected_set[i] != SELECT_IN)) {
        glUniform3fv(color_location, 1, &(colors[i][0])); 
     }
     else {
@@ -374,6 +1216,14 @@ void display(void) {
   glutSwapBuffers();
 }
 
+// Forget the hits of the last pick-through, whose ray no longer matches
+// its pixel or whose hits no longer match the cull mode
+void reset_pick_through() {
+  through_hits.clear();
+  through_x = -1;
+  through_y = -1;
+}
+
 // Respond to reshape events
 void reshape(int w, int h) {
 
@@ -386,146 +1236,1522 @@ void reshape(int w, int h) {
 
   // Compute the matrix inverse
   mvp_inverse = glm::inverse(mvp_matrix);
+  reset_pick_through();
 
   // Set the viewport
   glViewport(0, 0, (GLsizei)w, (GLsizei)h);
 }
 
-// Compute selection with OpenCL
-void execute_selection_kernel(glm::vec4 origin, glm::vec4 dir) {
+// Record a pick and redisplay the selection
+void set_pick_result(const PickResult& result) {
+
+  pick_result = result;
+  selected_object = result.object;
+  selected_set.clear();
+
+#ifdef DEBUG
+  if(result.object != UINT_MAX) {
+    std::cout << "Picked object " << result.object << ", triangle " << result.triangle 
+              << " at (" << result.point.x << ", " << result.point.y 
+              << ", " << result.point.z << ")" << std::endl;
+  }
+#endif
+  glutPostRedisplay();
+}
+
+// Convert the kernel arguments for a ray into a PickRay. The kernels
+// read the tolerance from origin.w and the cull mode from dir.w.
+PickRay make_ray(glm::vec4 origin, glm::vec4 dir) {
+  PickRay ray;
+  ray.origin = glm::vec3(origin.x, origin.y, origin.z);
+  ray.dir = glm::vec3(dir.x, dir.y, dir.z);
+  ray.cull = (PickCull)(int)dir.w;
+  ray.epsilon = origin.w;
+  return ray;
+}
+
+// Reduce the per-group results of a pick kernel into result slot out_index
+void enqueue_reduction(cl_mem t_buffer, cl_mem id_buffer, 
+                       cl_uint count, cl_uint out_index) {
 
   int err;
-  float *t_out, t_test = 1000.0f;
-  size_t num_groups, num_triangles, global_size;
-  unsigned int i, j;
 
-  // Create kernel arguments for the origin and direction
-  err = clSetKernelArg(kernel, 0, 4*sizeof(float), glm::value_ptr(origin));
-  err |= clSetKernelArg(kernel, 1, 4*sizeof(float), glm::value_ptr(dir));
+  err = clSetKernelArg(reduce_kernel, 0, sizeof(cl_mem), &t_buffer);
+  err |= clSetKernelArg(reduce_kernel, 1, sizeof(cl_mem), &id_buffer);
+  err |= clSetKernelArg(reduce_kernel, 2, sizeof(cl_uint), &count);
+  err |= clSetKernelArg(reduce_kernel, 3, sizeof(cl_mem), &t_result_buffer);
+  err |= clSetKernelArg(reduce_kernel, 4, sizeof(cl_mem), &id_result_buffer);
+  err |= clSetKernelArg(reduce_kernel, 5, sizeof(cl_uint), &out_index);
+  err |= clSetKernelArg(reduce_kernel, 6, reduce_group_size*sizeof(float), NULL);
+  err |= clSetKernelArg(reduce_kernel, 7, reduce_group_size*sizeof(cl_uint), NULL);
   if(err < 0) {
-    std::cerr << "Couldn't set a kernel argument: " << err << std::endl;
+    std::cerr << "Couldn't set a kernel argument" << std::endl;
     exit(1);
   };
 
-  // Complete OpenGL processing
-  glFinish();
+  // Execute a single work-group
+  err = clEnqueueNDRangeKernel(queue, reduce_kernel, 1, NULL, &reduce_group_size, 
+                               &reduce_group_size, 0, NULL, pick_profiler.event("reduce"));
+  if(err < 0) {
+    std::cerr << "Couldn't enqueue the kernel" << std::endl;
+    exit(1);   
+  }
+}
 
-  for(i=0; i<num_objects; i++) {
+// Make size bytes of a buffer, starting at offset, available to the host
+// and return where they will appear. Zero-copy devices map the buffer in
+// place, and the data must be handed back with finish_readback(). Other
+// devices read the data into host.
+void* enqueue_readback(cl_mem buffer, size_t offset, size_t size, void* host,
+                       cl_bool blocking, cl_event* done) {
 
-    // Create kernel argument from VBO
-    vbo_memobj = clCreateFromGLBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, vbos[2*i], &err);
-    if(err < 0) {
-      std::cerr << "Couldn't create a buffer object from a VBO" << std::endl;
-      exit(1);
-    }
+  void* data = host;
+  cl_event* event = (done != NULL) ? done : pick_profiler.event("readback");
+  cl_int err;
 
-    // Create kernel argument from IBO
-    ibo_memobj = clCreateFromGLBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, ibos[i], &err);
-    if(err < 0) {
-      std::cerr << "Couldn't create a buffer object from an IBO" << std::endl;
-      exit(1);
-    }
+  if(zero_copy) {
+    data = clEnqueueMapBuffer(queue, buffer, blocking, CL_MAP_READ, offset, size, 
+                              0, NULL, event, &err);
+  }
+  else {
+    err = clEnqueueReadBuffer(queue, buffer, blocking, offset, size, host, 
+                              0, NULL, event);
+  }
+  if(err < 0) {
+    std::cerr << "Couldn't read the buffer" << std::endl;
+    exit(1);   
+  }
+  if(done != NULL) {
+    pick_profiler.addEvent("readback", *done);
+  }
+  return data;
+}
 
-    // Determine global size
-    num_triangles = geom_vec[i].index_count/3;
-    num_groups = (size_t)(ceil((float)num_triangles/max_group_size));
-    global_size = num_groups * max_group_size;
+// Unmap data returned by enqueue_readback() once the host is done with it
+void finish_readback(cl_mem buffer, void* data) {
+  if(zero_copy) {
+    clEnqueueUnmapMemObject(queue, buffer, data, 0, NULL, NULL);
+  }
+}
 
-    // Allocate arrays for distance (t)
-    t_out = new float[num_groups];
+// Set the ray arguments of an indexed and a precomputed per-object kernel
+void set_object_kernel_ray(cl_kernel indexed, cl_kernel precomputed, 
+                           glm::vec4 origin, glm::vec4 dir) {
 
-    // Create buffer object for distance vector
-    t_out_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, 
-                                  num_groups * sizeof(float), NULL, &err);
-    if(err < 0) {
-      std::cerr << "Couldn't create a buffer object: " << std::endl;
-      exit(1);
-    };
+  int err;
 
-    // Make kernel arguments out of the VBO/IBO memory objects
-    err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &vbo_memobj);
-    err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &ibo_memobj);
-    err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &t_out_buffer);
-    err |= clSetKernelArg(kernel, 5, max_group_size*sizeof(float), NULL);
-    if(err < 0) {
-      std::cerr << "Couldn't set a kernel argument" << std::endl;
-      exit(1);
-    };
+  err = clSetKernelArg(indexed, 0, 4*sizeof(float), glm::value_ptr(origin));
+  err |= clSetKernelArg(indexed, 1, 4*sizeof(float), glm::value_ptr(dir));
+  err |= clSetKernelArg(indexed, 7, max_group_size*sizeof(float), NULL);
+  err |= clSetKernelArg(indexed, 8, max_group_size*sizeof(cl_uint), NULL);
+  err |= clSetKernelArg(precomputed, 0, 4*sizeof(float), glm::value_ptr(origin));
+  err |= clSetKernelArg(precomputed, 1, 4*sizeof(float), glm::value_ptr(dir));
+  err |= clSetKernelArg(precomputed, 6, max_group_size*sizeof(float), NULL);
+  err |= clSetKernelArg(precomputed, 7, max_group_size*sizeof(cl_uint), NULL);
+  if(err < 0) {
+    std::cerr << "Couldn't set a kernel argument: " << err << std::endl;
+    exit(1);
+  };
+}
+
+// Set the ray arguments of the generic and specialized per-object kernels
+void set_selection_ray(glm::vec4 origin, glm::vec4 dir) {
+
+  set_object_kernel_ray(kernel, precomputed_kernel, origin, dir);
+  for(std::map<std::string, KernelVariant>::iterator it = kernel_variants.begin(); 
+      it != kernel_variants.end(); it++) {
+    set_object_kernel_ray(it->second.kernel, it->second.precomputed_kernel, origin, dir);
+  }
+}
+
+// Test the triangles of object i and reduce them into result slot i
+void enqueue_object_kernel(unsigned int i) {
+
+  int err;
+  cl_uint num_triangles = geom_vec[i].index_count/3;
+  size_t num_groups = group_count(num_triangles, max_group_size);
+  size_t global_size = num_groups * max_group_size;
+  KernelVariant* variant = object_variants[i];
+  cl_kernel object_kernel = (variant != NULL) ? variant->kernel : kernel;
+  const char* stage = (variant != NULL) ? "variant kernel" : "object kernel";
+
+  // Read precomputed triangles if the object has them
+  if(precomputed_buffers[i] != NULL) {
+    object_kernel = (variant != NULL) ? variant->precomputed_kernel : precomputed_kernel;
+    err = clSetKernelArg(object_kernel, 2, sizeof(cl_mem), &precomputed_buffers[i]);
+    err |= clSetKernelArg(object_kernel, 3, sizeof(cl_uint), &num_triangles);
+    err |= clSetKernelArg(object_kernel, 4, sizeof(cl_mem), &t_out_buffers[i]);
+    err |= clSetKernelArg(object_kernel, 5, sizeof(cl_mem), &id_out_buffers[i]);
+  }
+
+  // Make kernel arguments out of the VBO/IBO memory objects
+  else {
+    err = clSetKernelArg(object_kernel, 2, sizeof(cl_mem), &vbo_memobjs[i]);
+    err |= clSetKernelArg(object_kernel, 3, sizeof(cl_mem), &ibo_memobjs[i]);
+    err |= clSetKernelArg(object_kernel, 4, sizeof(cl_uint), &num_triangles);
+    err |= clSetKernelArg(object_kernel, 5, sizeof(cl_mem), &t_out_buffers[i]);
+    err |= clSetKernelArg(object_kernel, 6, sizeof(cl_mem), &id_out_buffers[i]);
+  }
+  if(err < 0) {
+    std::cerr << "Couldn't set a kernel argument" << std::endl;
+    exit(1);
+  };
+
+  // Execute kernel
+  err = clEnqueueNDRangeKernel(queue, object_kernel, 1, NULL, &global_size, &max_group_size, 
+                               0, NULL, pick_profiler.event(stage));
+  if(err < 0) {
+    std::cerr << "Couldn't enqueue the kernel" << std::endl;
+    exit(1);   
+  }
+
+  // Reduce the object's groups to a single distance
+  enqueue_reduction(t_out_buffers[i], id_out_buffers[i], num_groups, i);
+}
+
+// Acquire the shared buffers once OpenGL has finished with them. With
+// cl_khr_gl_event the acquire waits on an OpenGL fence on the device,
+// so only the fence is returned in sync. Otherwise the host waits.
+void enqueue_acquire_gl_objects(GLsync* sync) {
+
+  cl_event gl_event = NULL;
+  double start = PickProfiler::now();
+  int err;
 
-    // Acquire lock on OpenGL objects
-    err = clEnqueueAcquireGLObjects(queue, 1, &vbo_memobj, 0, NULL, NULL);
-    err |= clEnqueueAcquireGLObjects(queue, 1, &ibo_memobj, 0, NULL, NULL);
+  *sync = 0;
+  if(zero_copy) {
+    return;
+  }
+  if(create_event_from_glsync != NULL) {
+    *sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+    gl_event = create_event_from_glsync(context, (cl_GLsync)*sync, &err);
     if(err < 0) {
-      std::cerr << "Couldn't acquire the GL objects" << std::endl;
+      std::cerr << "Couldn't create an event from the OpenGL fence" << std::endl;
       exit(1);   
     }
+  }
+  else {
+    glFinish();
+  }
+  pick_profiler.record("GL sync", PickProfiler::now() - start);
+
+  // Acquire lock on OpenGL objects
+  err = clEnqueueAcquireGLObjects(queue, num_objects, vbo_memobjs, gl_event != NULL, 
+                                  &gl_event, pick_profiler.event("acquire VBOs"));
+  err |= clEnqueueAcquireGLObjects(queue, num_objects, ibo_memobjs, 0, NULL, 
+                                   pick_profiler.event("acquire IBOs"));
+  if(err < 0) {
+    std::cerr << "Couldn't acquire the GL objects" << std::endl;
+    exit(1);   
+  }
+  if(gl_event != NULL) {
+    clReleaseEvent(gl_event);
+  }
+}
+
+// Release lock on OpenGL objects, returning an event for the release
+void enqueue_release_gl_objects(cl_event* done) {
+
+  int err;
+
+  // Without shared objects, only mark the end of the pick
+  if(zero_copy) {
+    if(done != NULL) {
+      clEnqueueMarker(queue, done);
+    }
+    return;
+  }
+  err = clEnqueueReleaseGLObjects(queue, num_objects, vbo_memobjs, 0, NULL, 
+                                  pick_profiler.event("release VBOs"));
+  err |= clEnqueueReleaseGLObjects(queue, num_objects, ibo_memobjs, 0, NULL, done);
+  if(err < 0) {
+    std::cerr << "Couldn't release the GL objects" << std::endl;
+    exit(1);   
+  }
+  if(done != NULL) {
+    pick_profiler.addEvent("release IBOs", *done);
+  }
+}
+
+// Compute selection with OpenCL, reading each object's result before
+// deciding whether the next object needs to be tested
+void execute_selection_kernel(glm::vec4 origin, glm::vec4 dir) {
+
+  float t_test = PICK_MISS, *t;
+  unsigned int i, triangle = UINT_MAX;
+  cl_uint* id;
+  std::vector<ObjectEntry> entries;
+  GLsync sync;
+  double start = PickProfiler::now();
+
+  // Order the objects whose bounds the ray hits, nearest first
+  pick_engine.orderObjects(make_ray(origin, dir), &entries);
+  pick_profiler.record("order objects", PickProfiler::now() - start);
+
+  set_selection_ray(origin, dir);
+  enqueue_acquire_gl_objects(&sync);
+
+  // Stop once the nearest hit lies in front of the next object's bounds
+  for(std::vector<ObjectEntry>::iterator it = entries.begin(); 
+      it < entries.end() && it->t < t_test; it++) {
+
+    // Launch the object's kernels and read its result
+    i = it->object;
+    enqueue_object_kernel(i);
+    t = (float*)enqueue_readback(t_result_buffer, i * sizeof(float), sizeof(float), 
+                                 &t_result[i], CL_FALSE, NULL);
+    id = (cl_uint*)enqueue_readback(id_result_buffer, i * sizeof(cl_uint), sizeof(cl_uint), 
+                                    &id_result[i], CL_TRUE, NULL);
+
+    // Check for smallest output and convert its triangle to a scene index
+    start = PickProfiler::now();
+    if(*t < t_test) {
+      t_test = *t;
+      triangle = pick_engine.firstTriangles()[i] + *id;
+    }
+    finish_readback(t_result_buffer, t);
+    finish_readback(id_result_buffer, id);
+    pick_profiler.record("host scan", PickProfiler::now() - start);
+  }
+  set_pick_result(pick_engine.makeResult(triangle, t_test, make_ray(origin, dir)));
+
+  enqueue_release_gl_objects(NULL);
+  clFinish(queue);
+  if(sync != 0) {
+    glDeleteSync(sync);
+  }
+  pick_profiler.resolveEvents();
+}
+
+// Launch every object the ray may hit, without waiting for any of them,
+// and read all the result slots with one pair of reads
+void enqueue_objects_pick(PendingPick* pick, cl_event* done) {
+
+  double start = PickProfiler::now();
+
+  pick_engine.orderObjects(make_ray(pick->origin, pick->dir), &pick->entries);
+  pick_profiler.record("order objects", PickProfiler::now() - start);
+
+  set_selection_ray(pick->origin, pick->dir);
+  enqueue_acquire_gl_objects(&pick->sync);
+  for(size_t i=0; i<pick->entries.size(); i++) {
+    enqueue_object_kernel(pick->entries[i].object);
+  }
+  pick->t_data = (float*)enqueue_readback(t_result_buffer, 0, num_objects * sizeof(float), 
+                                          t_result, CL_FALSE, NULL);
+  pick->id_data = (cl_uint*)enqueue_readback(id_result_buffer, 0, 
+                                             num_objects * sizeof(cl_uint), 
+                                             id_result, CL_FALSE, NULL);
+  enqueue_release_gl_objects(done);
+}
+
+// Compute selection over the whole scene with a single kernel launch
+void enqueue_scene_pick(PendingPick* pick, cl_event* done) {
+
+  int err;
+  size_t num_groups, global_size;
+
+  // Set kernel arguments
+  err = clSetKernelArg(scene_kernel, 0, 4*sizeof(float), glm::value_ptr(pick->origin));
+  err |= clSetKernelArg(scene_kernel, 1, 4*sizeof(float), glm::value_ptr(pick->dir));
+  err |= clSetKernelArg(scene_kernel, 2, sizeof(cl_mem), &scene_vbo);
+  err |= clSetKernelArg(scene_kernel, 3, sizeof(cl_mem), &scene_ibo);
+  err |= clSetKernelArg(scene_kernel, 4, sizeof(cl_uint), &num_scene_triangles);
+  err |= clSetKernelArg(scene_kernel, 5, sizeof(cl_mem), &scene_t_out);
+  err |= clSetKernelArg(scene_kernel, 6, sizeof(cl_mem), &scene_id_out);
+  err |= clSetKernelArg(scene_kernel, 7, scene_group_size*sizeof(float), NULL);
+  err |= clSetKernelArg(scene_kernel, 8, scene_group_size*sizeof(cl_uint), NULL);
+  if(err < 0) {
+    std::cerr << "Couldn't set a kernel argument: " << err << std::endl;
+    exit(1);
+  };
+
+  // Execute kernel
+  num_groups = group_count(num_scene_triangles, scene_group_size);
+  global_size = num_groups * scene_group_size;
+  err = clEnqueueNDRangeKernel(queue, scene_kernel, 1, NULL, &global_size, &scene_group_size, 
+                               0, NULL, pick_profiler.event("scene kernel"));
+  if(err < 0) {
+    std::cerr << "Couldn't enqueue the kernel" << std::endl;
+    exit(1);   
+  }
+
+  // Reduce the groups on the device and read back a single result
+  enqueue_reduction(scene_t_out, scene_id_out, num_groups, 0);
+  pick->t_data = (float*)enqueue_readback(t_result_buffer, 0, sizeof(float), 
+                                          t_result, CL_FALSE, NULL);
+  pick->id_data = (cl_uint*)enqueue_readback(id_result_buffer, 0, sizeof(cl_uint), 
+                                             id_result, CL_FALSE, done);
+}
+
+// Compute selection over the scene with each work-item testing packets
+// of vec_width triangles in vector registers
+void enqueue_vector_pick(PendingPick* pick, cl_event* done) {
+
+  int err;
+  size_t num_groups, global_size;
+
+  // Set kernel arguments
+  err = clSetKernelArg(vector_kernel, 0, 4*sizeof(float), glm::value_ptr(pick->origin));
+  err |= clSetKernelArg(vector_kernel, 1, 4*sizeof(float), glm::value_ptr(pick->dir));
+  err |= clSetKernelArg(vector_kernel, 2, sizeof(cl_mem), &vector_packets);
+  err |= clSetKernelArg(vector_kernel, 3, sizeof(cl_uint), &num_packets);
+  err |= clSetKernelArg(vector_kernel, 4, sizeof(cl_mem), &scene_t_out);
+  err |= clSetKernelArg(vector_kernel, 5, sizeof(cl_mem), &scene_id_out);
+  err |= clSetKernelArg(vector_kernel, 6, vector_group_size*sizeof(float), NULL);
+  err |= clSetKernelArg(vector_kernel, 7, vector_group_size*sizeof(cl_uint), NULL);
+  if(err < 0) {
+    std::cerr << "Couldn't set a kernel argument: " << err << std::endl;
+    exit(1);
+  };
+
+  // Execute kernel
+  num_groups = group_count(num_packets, vector_group_size);
+  global_size = num_groups * vector_group_size;
+  err = clEnqueueNDRangeKernel(queue, vector_kernel, 1, NULL, &global_size, &vector_group_size, 
+                               0, NULL, pick_profiler.event("vector kernel"));
+  if(err < 0) {
+    std::cerr << "Couldn't enqueue the kernel" << std::endl;
+    exit(1);   
+  }
+
+  // Reduce the groups on the device and read back a single result
+  enqueue_reduction(scene_t_out, scene_id_out, num_groups, 0);
+  pick->t_data = (float*)enqueue_readback(t_result_buffer, 0, sizeof(float), 
+                                          t_result, CL_FALSE, NULL);
+  pick->id_data = (cl_uint*)enqueue_readback(id_result_buffer, 0, sizeof(cl_uint), 
+                                             id_result, CL_FALSE, done);
+}
+
+// Compute selection with a single work-item traversing the BVH
+void enqueue_bvh_pick(PendingPick* pick, cl_event* done) {
+
+  size_t global_size = 1;
+  int err;
+
+  // Set kernel arguments
+  err = clSetKernelArg(bvh_kernel, 0, 4*sizeof(float), glm::value_ptr(pick->origin));
+  err |= clSetKernelArg(bvh_kernel, 1, 4*sizeof(float), glm::value_ptr(pick->dir));
+  err |= clSetKernelArg(bvh_kernel, 2, sizeof(cl_mem), &bvh_nodes);
+  err |= clSetKernelArg(bvh_kernel, 3, sizeof(cl_mem), &bvh_order);
+  err |= clSetKernelArg(bvh_kernel, 4, sizeof(cl_mem), &scene_vbo);
+  err |= clSetKernelArg(bvh_kernel, 5, sizeof(cl_mem), &scene_ibo);
+  err |= clSetKernelArg(bvh_kernel, 6, sizeof(cl_mem), &t_result_buffer);
+  err |= clSetKernelArg(bvh_kernel, 7, sizeof(cl_mem), &id_result_buffer);
+  if(err < 0) {
+    std::cerr << "Couldn't set a kernel argument: " << err << std::endl;
+    exit(1);
+  };
+
+  // Execute kernel
+  err = clEnqueueNDRangeKernel(queue, bvh_kernel, 1, NULL, &global_size, &global_size, 
+                               0, NULL, pick_profiler.event("BVH kernel"));
+  if(err < 0) {
+    std::cerr << "Couldn't enqueue the kernel" << std::endl;
+    exit(1);   
+  }
+
+  // Read the distance and triangle
+  pick->t_data = (float*)enqueue_readback(t_result_buffer, 0, sizeof(float), 
+                                          t_result, CL_FALSE, NULL);
+  pick->id_data = (cl_uint*)enqueue_readback(id_result_buffer, 0, sizeof(cl_uint), 
+                                             id_result, CL_FALSE, done);
+}
+
+// Pick a batch of rays with one launch and one readback
+void execute_batch_kernel(const std::vector<PickRay>& rays, 
+                          std::vector<PickResult>* results) {
+
+  std::vector<glm::vec4> ray_data(2 * rays.size());
+  std::vector<float> t_out(rays.size());
+  std::vector<cl_uint> id_out(rays.size());
+  float* t_data;
+  cl_uint* id_data, num_rays = rays.size();
+  size_t global_size;
+  int err;
+
+  results->resize(num_rays);
+  if(num_rays == 0) {
+    return;
+  }
+  reserve_batch_buffers(num_rays);
+
+  // Upload the rays as origin/direction pairs
+  for(size_t i=0; i<rays.size(); i++) {
+    ray_data[2*i] = glm::vec4(rays[i].origin, rays[i].epsilon);
+    ray_data[2*i+1] = glm::vec4(rays[i].dir, (float)rays[i].cull);
+  }
+  err = clEnqueueWriteBuffer(queue, batch_rays, CL_FALSE, 0, 
+                             2 * num_rays * sizeof(cl_float4), &ray_data[0], 
+                             0, NULL, pick_profiler.event("write"));
+  if(err < 0) {
+    std::cerr << "Couldn't write the buffer" << std::endl;
+    exit(1);   
+  }
+
+  // Set kernel arguments
+  err = clSetKernelArg(batch_kernel, 0, sizeof(cl_mem), &batch_rays);
+  err |= clSetKernelArg(batch_kernel, 1, sizeof(cl_uint), &num_rays);
+  err |= clSetKernelArg(batch_kernel, 2, sizeof(cl_mem), &bvh_nodes);
+  err |= clSetKernelArg(batch_kernel, 3, sizeof(cl_mem), &bvh_order);
+  err |= clSetKernelArg(batch_kernel, 4, sizeof(cl_mem), &scene_vbo);
+  err |= clSetKernelArg(batch_kernel, 5, sizeof(cl_mem), &scene_ibo);
+  err |= clSetKernelArg(batch_kernel, 6, sizeof(cl_mem), &batch_t);
+  err |= clSetKernelArg(batch_kernel, 7, sizeof(cl_mem), &batch_id);
+  if(err < 0) {
+    std::cerr << "Couldn't set a kernel argument: " << err << std::endl;
+    exit(1);
+  };
+
+  // Execute kernel with one work-item per ray
+  global_size = (num_rays + batch_group_size - 1)/batch_group_size * batch_group_size;
+  err = clEnqueueNDRangeKernel(queue, batch_kernel, 1, NULL, &global_size, &batch_group_size, 
+                               0, NULL, pick_profiler.event("batch kernel"));
+  if(err < 0) {
+    std::cerr << "Couldn't enqueue the kernel" << std::endl;
+    exit(1);   
+  }
+
+  // Read every ray's distance and triangle
+  t_data = (float*)enqueue_readback(batch_t, 0, num_rays * sizeof(float), 
+                                    &t_out[0], CL_FALSE, NULL);
+  id_data = (cl_uint*)enqueue_readback(batch_id, 0, num_rays * sizeof(cl_uint), 
+                                       &id_out[0], CL_TRUE, NULL);
+  for(size_t i=0; i<rays.size(); i++) {
+    (*results)[i] = pick_engine.makeResult(id_data[i], t_data[i], rays[i]);
+  }
+  finish_readback(batch_t, t_data);
+  finish_readback(batch_id, id_data);
+  pick_profiler.resolveEvents();
+}
+
+
+// Compute selection over the scene with the result in one atomic slot
+void enqueue_atomic_pick(PendingPick* pick, cl_event* done) {
+
+  static const cl_ulong empty_key = ~(cl_ulong)0;
+  size_t num_groups, global_size;
+  int err;
+
+  // Set kernel arguments
+  err = clSetKernelArg(atomic_kernel, 0, 4*sizeof(float), glm::value_ptr(pick->origin));
+  err |= clSetKernelArg(atomic_kernel, 1, 4*sizeof(float), glm::value_ptr(pick->dir));
+  err |= clSetKernelArg(atomic_kernel, 2, sizeof(cl_mem), &scene_vbo);
+  err |= clSetKernelArg(atomic_kernel, 3, sizeof(cl_mem), &scene_ibo);
+  err |= clSetKernelArg(atomic_kernel, 4, sizeof(cl_uint), &num_scene_triangles);
+  err |= clSetKernelArg(atomic_kernel, 5, sizeof(cl_mem), &atomic_result);
+  err |= clSetKernelArg(atomic_kernel, 6, atomic_group_size*sizeof(float), NULL);
+  err |= clSetKernelArg(atomic_kernel, 7, atomic_group_size*sizeof(cl_uint), NULL);
+  if(err < 0) {
+    std::cerr << "Couldn't set a kernel argument: " << err << std::endl;
+    exit(1);
+  };
+
+  // Clear the result slot
+  err = clEnqueueWriteBuffer(queue, atomic_result, CL_FALSE, 0, sizeof(cl_ulong), 
+                             &empty_key, 0, NULL, pick_profiler.event("write"));
+  if(err < 0) {
+    std::cerr << "Couldn't write the buffer" << std::endl;
+    exit(1);   
+  }
+
+  // Execute kernel
+  num_groups = group_count(num_scene_triangles, atomic_group_size);
+  global_size = num_groups * atomic_group_size;
+  err = clEnqueueNDRangeKernel(queue, atomic_kernel, 1, NULL, &global_size, &atomic_group_size, 
+                               0, NULL, pick_profiler.event("atomic kernel"));
+  if(err < 0) {
+    std::cerr << "Couldn't enqueue the kernel" << std::endl;
+    exit(1);   
+  }
+
+  // Read the 8-byte key
+  pick->key_data = (cl_ulong*)enqueue_readback(atomic_result, 0, sizeof(cl_ulong), 
+                                               &atomic_key, CL_FALSE, done);
+}
+
+// Enqueue the commands of a GPU pick, returning the event of its last command
+void enqueue_pick(PendingPick* pick, cl_event* done) {
+
+  if(pick->mode == PICK_SCENE) {
+    enqueue_scene_pick(pick, done);
+  }
+  else if(pick->mode == PICK_VECTOR) {
+    enqueue_vector_pick(pick, done);
+  }
+  else if(pick->mode == PICK_ATOMIC) {
+    enqueue_atomic_pick(pick, done);
+  }
+  else if(pick->mode == PICK_BVH) {
+    enqueue_bvh_pick(pick, done);
+  }
+  else {
+    enqueue_objects_pick(pick, done);
+  }
+}
+
+// Build the result of a pick whose readback has completed
+PickResult collect_pick(const PendingPick& pick) {
+
+  float t = PICK_MISS;
+  unsigned int i, triangle = UINT_MAX;
+  cl_ulong key;
+  cl_uint t_bits;
+
+  if(pick.mode == PICK_ATOMIC) {
+
+    // Unpack the distance and triangle
+    key = *pick.key_data;
+    if(key != ~(cl_ulong)0) {
+      t_bits = (cl_uint)(key >> 32);
+      memcpy(&t, &t_bits, sizeof(float));
+      triangle = (cl_uint)(key & 0xFFFFFFFF);
+    }
+    finish_readback(atomic_result, pick.key_data);
+    return pick_engine.makeResult(triangle, t, make_ray(pick.origin, pick.dir));
+  }
+  else if(pick.mode == PICK_OBJECTS) {
+
+    // Find the smallest distance among the launched objects
+    for(size_t j=0; j<pick.entries.size(); j++) {
+      i = pick.entries[j].object;
+      if(pick.t_data[i] < t) {
+        t = pick.t_data[i];
+        triangle = pick_engine.firstTriangles()[i] + pick.id_data[i];
+      }
+    }
+  }
+  else {
+    t = pick.t_data[0];
+    triangle = pick.id_data[0];
+  }
+  finish_readback(t_result_buffer, pick.t_data);
+  finish_readback(id_result_buffer, pick.id_data);
+  return pick_engine.makeResult(triangle, t, make_ray(pick.origin, pick.dir));
+}
+
+// Count the picks whose commands have completed. Called by OpenCL,
+// possibly on another thread, so it only touches the atomic counter.
+void CL_CALLBACK count_completed_pick(cl_event event, cl_int status, void* data) {
+  picks_completed++;
+}
+
+// Enqueue the pick at the front of the list without waiting for it
+void start_pick() {
+
+  int err;
+
+  enqueue_pick(&pending_picks.front(), &pick_event);
+  err = clSetEventCallback(pick_event, CL_COMPLETE, count_completed_pick, NULL);
+  if(err < 0) {
+    std::cerr << "Couldn't set the event callback" << std::endl;
+    exit(1);   
+  }
+  clFlush(queue);
+}
+
+// Remove the front pick, start the next one and deliver the result
+void deliver_pick() {
+
+  PendingPick pick = pending_picks.front();
+  PickResult result;
+
+  pending_picks.pop_front();
+  picks_delivered++;
+  clReleaseEvent(pick_event);
+  if(pick.sync != 0) {
+    glDeleteSync(pick.sync);
+  }
+
+  // Collect before the next pick reuses the host arrays
+  result = collect_pick(pick);
+  pick_profiler.resolveEvents();
+  pick_profiler.record(std::string(pick_mode_names[pick.mode]) + " pick", 
+                       PickProfiler::now() - pick.submit_time);
+  if(!pending_picks.empty()) {
+    start_pick();
+  }
+  pick.callback(result);
+}
+
+// Poll from the GLUT loop for completed picks
+void poll_picks(int value) {
+
+  if(picks_completed > picks_delivered) {
+    deliver_pick();
+  }
+  poll_scheduled = !pending_picks.empty();
+  if(poll_scheduled) {
+    glutTimerFunc(PICK_POLL_MS, poll_picks, 0);
+  }
+}
+
+// Queue a pick and return immediately. The callback runs on the GLUT
+// thread once the pick's results have been read.
+void submit_pick(glm::vec4 origin, glm::vec4 dir, 
+                 void (*callback)(const PickResult&)) {
 
-    // Execute kernel
-    err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global_size, 
-                                 &max_group_size, 0, NULL, NULL);
+  PendingPick pick;
+
+  // An empty scene has nothing to launch or read back, so it always misses
+  if(num_scene_triangles == 0) {
+    callback(pick_engine.makeResult(UINT_MAX, PICK_MISS, make_ray(origin, dir)));
+    return;
+  }
+  pick.mode = pick_mode;
+  pick.origin = origin;
+  pick.dir = dir;
+  pick.submit_time = PickProfiler::now();
+  pick.sync = 0;
+  pick.callback = callback;
+  pending_picks.push_back(pick);
+  if(pending_picks.size() == 1) {
+    start_pick();
+  }
+  if(!poll_scheduled) {
+    poll_scheduled = true;
+    glutTimerFunc(PICK_POLL_MS, poll_picks, 0);
+  }
+}
+
+// Wait for the queued picks and deliver their results
+void finish_pending_picks() {
+
+  while(!pending_picks.empty()) {
+    clWaitForEvents(1, &pick_event);
+    deliver_pick();
+  }
+}
+
+// Pick in the current mode and wait for the result
+void execute_pick(glm::vec4 origin, glm::vec4 dir) {
+
+  PendingPick pick;
+  cl_event done;
+
+  finish_pending_picks();
+  if(num_scene_triangles == 0) {
+    set_pick_result(pick_engine.makeResult(UINT_MAX, PICK_MISS, make_ray(origin, dir)));
+    return;
+  }
+  if(pick_mode == PICK_OBJECTS) {
+    execute_selection_kernel(origin, dir);
+    return;
+  }
+  pick.mode = pick_mode;
+  pick.origin = origin;
+  pick.dir = dir;
+  pick.sync = 0;
+  enqueue_pick(&pick, &done);
+  clWaitForEvents(1, &done);
+  clReleaseEvent(done);
+  set_pick_result(collect_pick(pick));
+  pick_profiler.resolveEvents();
+}
+
+// Clear the hit counter and launch a hits kernel that appends at most
+// capacity hits to t_buffer and id_buffer
+void enqueue_hits_kernel(glm::vec4 origin, glm::vec4 dir, bool nearest, 
+                         cl_mem t_buffer, cl_mem id_buffer, cl_uint capacity) {
+
+  static const cl_uint zero = 0;
+  cl_kernel hits_kernel = nearest ? nearest_kernel : all_hits_kernel;
+  size_t group_size = nearest ? nearest_group_size : all_hits_group_size;
+  size_t global_size = group_count(num_scene_triangles, group_size) * group_size;
+  int err;
+
+  // Set kernel arguments
+  err = clSetKernelArg(hits_kernel, 0, 4*sizeof(float), glm::value_ptr(origin));
+  err |= clSetKernelArg(hits_kernel, 1, 4*sizeof(float), glm::value_ptr(dir));
+  err |= clSetKernelArg(hits_kernel, 2, sizeof(cl_mem), &scene_vbo);
+  err |= clSetKernelArg(hits_kernel, 3, sizeof(cl_mem), &scene_ibo);
+  err |= clSetKernelArg(hits_kernel, 4, sizeof(cl_uint), &num_scene_triangles);
+  err |= clSetKernelArg(hits_kernel, 5, sizeof(cl_mem), &t_buffer);
+  err |= clSetKernelArg(hits_kernel, 6, sizeof(cl_mem), &id_buffer);
+  err |= clSetKernelArg(hits_kernel, 7, sizeof(cl_mem), &hit_count);
+  err |= clSetKernelArg(hits_kernel, 8, sizeof(cl_uint), &capacity);
+  if(nearest) {
+    err |= clSetKernelArg(hits_kernel, 9, 
+                          group_size*NEAREST_HITS*sizeof(float), NULL);
+    err |= clSetKernelArg(hits_kernel, 10, 
+                          group_size*NEAREST_HITS*sizeof(cl_uint), NULL);
+  }
+  if(err < 0) {
+    std::cerr << "Couldn't set a kernel argument: " << err << std::endl;
+    exit(1);
+  };
+
+  // Clear the hit counter
+  err = clEnqueueWriteBuffer(queue, hit_count, CL_FALSE, 0, sizeof(cl_uint), 
+                             &zero, 0, NULL, pick_profiler.event("write"));
+  if(err < 0) {
+    std::cerr << "Couldn't write the buffer" << std::endl;
+    exit(1);   
+  }
+
+  // Collect the hits
+  err = clEnqueueNDRangeKernel(queue, hits_kernel, 1, NULL, &global_size, &group_size, 
+                               0, NULL, pick_profiler.event(nearest ? 
+                               "nearest hits kernel" : "all hits kernel"));
+  if(err < 0) {
+    std::cerr << "Couldn't enqueue the kernel" << std::endl;
+    exit(1);   
+  }
+}
+
+// Collect the hits again into buffers holding all count of them, then keep
+// the MAX_HITS nearest, sorted on the host. The kernels append hits in no
+// particular order, so the hits past MAX_HITS in the first pass may
+// include the nearest one.
+void collect_overflowing_hits(glm::vec4 origin, glm::vec4 dir, bool nearest, 
+                              cl_uint count, std::vector<PickResult>* hits) {
+
+  std::vector<float> t_host(count);
+  std::vector<cl_uint> id_host(count);
+  std::vector<std::pair<float, cl_uint> > order(count);
+  PickRay ray = make_ray(origin, dir);
+  cl_mem t_buffer, id_buffer;
+  int err;
+
+  t_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, 
+                            count * sizeof(float), NULL, &err);
+  if(err == CL_SUCCESS) {
+    id_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, 
+                               count * sizeof(cl_uint), NULL, &err);
+  }
+  if(err < 0) {
+    std::cerr << "Couldn't create a buffer object" << std::endl;
+    exit(1);   
+  }
+
+  enqueue_hits_kernel(origin, dir, nearest, t_buffer, id_buffer, count);
+  err = clEnqueueReadBuffer(queue, t_buffer, CL_FALSE, 0, count * sizeof(float), 
+                            &t_host[0], 0, NULL, pick_profiler.event("readback"));
+  err |= clEnqueueReadBuffer(queue, id_buffer, CL_TRUE, 0, count * sizeof(cl_uint), 
+                             &id_host[0], 0, NULL, pick_profiler.event("readback"));
+  if(err < 0) {
+    std::cerr << "Couldn't read the buffer" << std::endl;
+    exit(1);   
+  }
+  clReleaseMemObject(t_buffer);
+  clReleaseMemObject(id_buffer);
+
+  // Sort by distance, then triangle, as clgl_sort_hits does
+  for(cl_uint i=0; i<count; i++) {
+    order[i] = std::make_pair(t_host[i], id_host[i]);
+  }
+  std::partial_sort(order.begin(), order.begin() + MAX_HITS, order.end());
+  for(cl_uint i=0; i<MAX_HITS; i++) {
+    hits->push_back(pick_engine.makeResult(order[i].second, order[i].first, ray));
+  }
+}
+
+// Find the hits along a ray, sorted by distance on the device. The
+// nearest-hits kernel only appends the NEAREST_HITS nearest hits of each
+// work-group. When more than MAX_HITS hits are found, a second pass keeps
+// the MAX_HITS nearest.
+void execute_hits_kernel(glm::vec4 origin, glm::vec4 dir, bool nearest, 
+                         std::vector<PickResult>* hits) {
+
+  cl_uint max_hits = MAX_HITS, count;
+  cl_uint* count_data;
+  float* t_data;
+  cl_uint* id_data;
+  float t_host[MAX_HITS];
+  cl_uint id_host[MAX_HITS];
+  PickRay ray = make_ray(origin, dir);
+  int err;
+
+  finish_pending_picks();
+  hits->clear();
+  if(num_scene_triangles == 0) {
+    return;
+  }
+
+  // Set the sort kernel's arguments
+  err = clSetKernelArg(sort_kernel, 0, sizeof(cl_mem), &hit_t);
+  err |= clSetKernelArg(sort_kernel, 1, sizeof(cl_mem), &hit_id);
+  err |= clSetKernelArg(sort_kernel, 2, sizeof(cl_mem), &hit_count);
+  err |= clSetKernelArg(sort_kernel, 3, sizeof(cl_uint), &max_hits);
+  err |= clSetKernelArg(sort_kernel, 4, MAX_HITS*sizeof(float), NULL);
+  err |= clSetKernelArg(sort_kernel, 5, MAX_HITS*sizeof(cl_uint), NULL);
+  if(err < 0) {
+    std::cerr << "Couldn't set a kernel argument: " << err << std::endl;
+    exit(1);
+  };
+
+  // Collect the hits, then sort them in a single work-group
+  enqueue_hits_kernel(origin, dir, nearest, hit_t, hit_id, max_hits);
+  err = clEnqueueNDRangeKernel(queue, sort_kernel, 1, NULL, &sort_group_size, 
+                               &sort_group_size, 0, NULL, 
+                               pick_profiler.event("sort kernel"));
+  if(err < 0) {
+    std::cerr << "Couldn't enqueue the kernel" << std::endl;
+    exit(1);   
+  }
+
+  // Read the number of hits, then the sorted hits
+  count_data = (cl_uint*)enqueue_readback(hit_count, 0, sizeof(cl_uint), 
+                                          &count, CL_TRUE, NULL);
+  count = *count_data;
+  finish_readback(hit_count, count_data);
+  if(count > max_hits) {
+    collect_overflowing_hits(origin, dir, nearest, count, hits);
+  }
+  else if(count > 0) {
+    t_data = (float*)enqueue_readback(hit_t, 0, count*sizeof(float), 
+                                      t_host, CL_FALSE, NULL);
+    id_data = (cl_uint*)enqueue_readback(hit_id, 0, count*sizeof(cl_uint), 
+                                         id_host, CL_TRUE, NULL);
+    for(cl_uint i=0; i<count; i++) {
+      hits->push_back(pick_engine.makeResult(id_data[i], t_data[i], ray));
+    }
+    finish_readback(hit_t, t_data);
+    finish_readback(hit_id, id_data);
+  }
+  pick_profiler.resolveEvents();
+}
+
+// Select the nearest object along the ray, or the object behind the one
+// selected last if the click repeats the previous one
+void pick_through(int x, int y, glm::vec4 origin, glm::vec4 dir) {
+
+  std::vector<PickResult> hits;
+  std::vector<bool> seen(num_objects, false);
+  PickResult miss;
+
+  // Step to the next object along the previous ray
+  if(x == through_x && y == through_y && !through_hits.empty()) {
+    through_index = (through_index + 1) % through_hits.size();
+    set_pick_result(through_hits[through_index]);
+    return;
+  }
+
+  // Keep the nearest hit on each object
+  execute_hits_kernel(origin, dir, through_mode == THROUGH_NEAREST, &hits);
+  through_hits.clear();
+  for(size_t i=0; i<hits.size(); i++) {
+    if(!seen[hits[i].object]) {
+      seen[hits[i].object] = true;
+      through_hits.push_back(hits[i]);
+    }
+  }
+  through_x = x;
+  through_y = y;
+  through_index = 0;
+  if(through_hits.empty()) {
+    miss.object = UINT_MAX;
+    set_pick_result(miss);
+  }
+  else {
+    set_pick_result(through_hits[0]);
+  }
+}
+
+// Classify the box of each object against the frustum, giving boxes
+// inside the frustum inside_state
+void enqueue_object_selection(const PickFrustum& frustum, cl_uchar inside_state) {
+
+  float frustum_data[14*4];
+  size_t global_size;
+  int err;
+
+  // Store the planes, then the corners
+  for(int i=0; i<6; i++) {
+    std::copy(&frustum.planes[i][0], &frustum.planes[i][0] + 4, &frustum_data[4*i]);
+  }
+  for(int i=0; i<8; i++) {
+    std::copy(&frustum.corners[i][0], &frustum.corners[i][0] + 3, &frustum_data[4*(6+i)]);
+    frustum_data[4*(6+i) + 3] = 1.0f;
+  }
+  err = clEnqueueWriteBuffer(queue, frustum_buffer, CL_TRUE, 0, sizeof(frustum_data), 
+                             frustum_data, 0, NULL, pick_profiler.event("write"));
+  if(err < 0) {
+    std::cerr << "Couldn't write the buffer" << std::endl;
+    exit(1);   
+  }
+
+  // Set kernel arguments
+  err = clSetKernelArg(select_objects_kernel, 0, sizeof(cl_mem), &frustum_buffer);
+  err |= clSetKernelArg(select_objects_kernel, 1, sizeof(cl_mem), &object_boxes);
+  err |= clSetKernelArg(select_objects_kernel, 2, sizeof(cl_uint), &num_objects);
+  err |= clSetKernelArg(select_objects_kernel, 3, sizeof(cl_mem), &object_state);
+  err |= clSetKernelArg(select_objects_kernel, 4, sizeof(cl_uchar), &inside_state);
+  if(err < 0) {
+    std::cerr << "Couldn't set a kernel argument: " << err << std::endl;
+    exit(1);
+  };
+
+  // Execute kernel
+  global_size = (num_objects + select_objects_group_size - 1) / 
+                select_objects_group_size * select_objects_group_size;
+  err = clEnqueueNDRangeKernel(queue, select_objects_kernel, 1, NULL, &global_size, 
+                               &select_objects_group_size, 0, NULL, 
+                               pick_profiler.event("select objects kernel"));
+  if(err < 0) {
+    std::cerr << "Couldn't enqueue the kernel" << std::endl;
+    exit(1);   
+  }
+}
+
+// Wait for a selection and read the state of each object
+void read_selection(std::vector<unsigned char>* selected) {
+
+  unsigned char* state_data;
+
+  state_data = (unsigned char*)enqueue_readback(object_state, 0, num_objects, 
+                                                &(*selected)[0], CL_TRUE, NULL);
+  if(state_data != &(*selected)[0]) {
+    std::copy(state_data, state_data + num_objects, selected->begin());
+  }
+  finish_readback(object_state, state_data);
+  pick_profiler.resolveEvents();
+}
+
+// Select the objects with a triangle in the frustum. Object boxes are
+// classified first, so only the triangles of objects straddling the
+// frustum are tested.
+void execute_box_selection(const PickFrustum& frustum, 
+                           std::vector<unsigned char>* selected) {
+
+  size_t global_size;
+  int err;
+
+  finish_pending_picks();
+  selected->assign(num_objects, SELECT_OUT);
+  if(num_objects == 0) {
+    return;
+  }
+  enqueue_object_selection(frustum, SELECT_IN);
+
+  // Test the triangles of straddling objects
+  err = clSetKernelArg(select_triangles_kernel, 0, sizeof(cl_mem), &frustum_buffer);
+  err |= clSetKernelArg(select_triangles_kernel, 1, sizeof(cl_mem), &scene_vbo);
+  err |= clSetKernelArg(select_triangles_kernel, 2, sizeof(cl_mem), &scene_ibo);
+  err |= clSetKernelArg(select_triangles_kernel, 3, sizeof(cl_uint), &num_scene_triangles);
+  err |= clSetKernelArg(select_triangles_kernel, 4, sizeof(cl_mem), &triangle_objects);
+  err |= clSetKernelArg(select_triangles_kernel, 5, sizeof(cl_mem), &object_state);
+  if(err < 0) {
+    std::cerr << "Couldn't set a kernel argument: " << err << std::endl;
+    exit(1);
+  };
+  if(num_scene_triangles > 0) {
+    global_size = group_count(num_scene_triangles, select_triangles_group_size) * 
+                  select_triangles_group_size;
+    err = clEnqueueNDRangeKernel(queue, select_triangles_kernel, 1, NULL, &global_size, 
+                                 &select_triangles_group_size, 0, NULL, 
+                                 pick_profiler.event("select triangles kernel"));
     if(err < 0) {
       std::cerr << "Couldn't enqueue the kernel" << std::endl;
       exit(1);   
     }
+  }
+  read_selection(selected);
+}
 
-    // Read t_out results
-    err = clEnqueueReadBuffer(queue, t_out_buffer, CL_TRUE, 0, 
-                              num_groups * sizeof(float), t_out, 0, NULL, NULL);
-    if(err < 0) {
-      std::cerr << "Couldn't read the buffer" << std::endl;
-      exit(1);   
+// Select the objects with a vertex inside a polygon given in normalized
+// device coordinates. Objects outside the polygon's bounding rectangle
+// are culled before their vertices are projected.
+void execute_lasso_selection(const std::vector<glm::vec2>& polygon, 
+                             std::vector<unsigned char>* selected) {
+
+  glm::vec2 lo = polygon[0], hi = polygon[0];
+  cl_uint num_points = polygon.size();
+  size_t global_size;
+  int err;
+
+  finish_pending_picks();
+  selected->assign(num_objects, SELECT_OUT);
+  if(num_objects == 0 || num_points < 3 || num_scene_vertices == 0) {
+    return;
+  }
+  for(size_t i=1; i<polygon.size(); i++) {
+    lo = glm::min(lo, polygon[i]);
+    hi = glm::max(hi, polygon[i]);
+  }
+  enqueue_object_selection(PickEngine::screenFrustum(mvp_matrix, lo, hi), SELECT_CHECK);
+
+  // Store the polygon
+  err = clEnqueueWriteBuffer(queue, lasso_polygon, CL_TRUE, 0, 
+                             num_points * 2 * sizeof(float), &polygon[0], 
+                             0, NULL, pick_profiler.event("write"));
+  if(err < 0) {
+    std::cerr << "Couldn't write the buffer" << std::endl;
+    exit(1);   
+  }
+
+  // Test the vertices of objects in the bounding rectangle
+  err = clSetKernelArg(lasso_kernel, 0, 16*sizeof(float), glm::value_ptr(mvp_matrix));
+  err |= clSetKernelArg(lasso_kernel, 1, sizeof(cl_mem), &lasso_polygon);
+  err |= clSetKernelArg(lasso_kernel, 2, sizeof(cl_uint), &num_points);
+  err |= clSetKernelArg(lasso_kernel, 3, sizeof(cl_mem), &scene_vbo);
+  err |= clSetKernelArg(lasso_kernel, 4, sizeof(cl_uint), &num_scene_vertices);
+  err |= clSetKernelArg(lasso_kernel, 5, sizeof(cl_mem), &vertex_objects);
+  err |= clSetKernelArg(lasso_kernel, 6, sizeof(cl_mem), &object_state);
+  if(err < 0) {
+    std::cerr << "Couldn't set a kernel argument: " << err << std::endl;
+    exit(1);
+  };
+  global_size = group_count(num_scene_vertices, lasso_group_size) * lasso_group_size;
+  err = clEnqueueNDRangeKernel(queue, lasso_kernel, 1, NULL, &global_size, 
+                               &lasso_group_size, 0, NULL, 
+                               pick_profiler.event("lasso kernel"));
+  if(err < 0) {
+    std::cerr << "Couldn't enqueue the kernel" << std::endl;
+    exit(1);   
+  }
+  read_selection(selected);
+}
+
+// Convert a pixel of the window to normalized device coordinates
+glm::vec2 window_to_ndc(float x, float y) {
+  return glm::vec2((x-half_width)/half_width, (half_height-y)/half_height);
+}
+
+// Select the objects in the rectangle between the start of the drag and
+// the given pixel
+void select_box(int x, int y) {
+
+  PickFrustum frustum = PickEngine::screenFrustum(mvp_matrix, 
+    window_to_ndc(marquee_x, marquee_y), window_to_ndc(x, y));
+  double start = PickProfiler::now();
+
+  if(pick_mode == PICK_CPU) {
+    pick_engine.selectFrustum(frustum, &selected_set);
+  }
+  else {
+    execute_box_selection(frustum, &selected_set);
+  }
+  pick_profiler.record("box selection", PickProfiler::now() - start);
+  selected_object = UINT_MAX;
+  glutPostRedisplay();
+}
+
+// Select the objects inside the lasso traced with the middle button
+void select_lasso() {
+
+  std::vector<glm::vec2> polygon;
+  double start = PickProfiler::now();
+
+  for(size_t i=0; i<lasso_points.size(); i++) {
+    polygon.push_back(window_to_ndc(lasso_points[i].x, lasso_points[i].y));
+  }
+  if(pick_mode == PICK_CPU) {
+    pick_engine.selectLasso(mvp_matrix, polygon, &selected_set);
+  }
+  else if(polygon.size() >= 3) {
+    execute_lasso_selection(polygon, &selected_set);
+  }
+  else {
+    selected_set.assign(num_objects, SELECT_OUT);
+  }
+  pick_profiler.record("lasso selection", PickProfiler::now() - start);
+  selected_object = UINT_MAX;
+  glutPostRedisplay();
+}
+
+void issue_hover_pick();
+
+// Highlight the object under the pointer, then pick the newest motion
+// event if one arrived while this pick was in flight
+void deliver_hover(const PickResult& result) {
+
+  hover_in_flight = false;
+  pick_profiler.record("hover latency", PickProfiler::now() - hover_event_time);
+  if(hover_picking && result.object != hovered_object) {
+    hovered_object = result.object;
+    glutPostRedisplay();
+  }
+  if(hover_waiting) {
+    issue_hover_pick();
+  }
+}
+
+// Issue the hover pick put off by the rate limit
+void hover_timer(int value) {
+  hover_timer_set = false;
+  if(hover_waiting && !hover_in_flight) {
+    issue_hover_pick();
+  }
+}
+
+// Run a CPU or multi-device hover pick off the GLUT thread
+void run_hover_pick(PickMode mode, PickRay ray) {
+  hover_result = (mode == PICK_CPU) ? pick_engine.pick(ray) : pick_scheduler.pick(ray);
+  hover_done = true;
+}
+
+// Poll from the GLUT loop for the end of the pick on hover_thread
+void poll_hover(int value) {
+
+  if(!hover_done) {
+    glutTimerFunc(PICK_POLL_MS, poll_hover, 0);
+    return;
+  }
+  if(hover_thread.joinable()) {
+    hover_thread.join();
+  }
+  hover_done = false;
+  deliver_hover(hover_result);
+}
+
+// Wait for the pick on hover_thread, leaving its delivery to poll_hover().
+// The scheduler can't run two picks at once.
+void finish_hover_thread() {
+  if(hover_thread.joinable()) {
+    hover_thread.join();
+  }
+}
+
+// Pick the newest motion event, waiting until HOVER_INTERVAL_MS has passed
+// since the previous hover pick. GPU picks are queued, and CPU and
+// multi-device picks run on hover_thread, so none blocks the GLUT thread.
+void issue_hover_pick() {
+
+  double now = PickProfiler::now();
+  double wait = hover_last_submit + HOVER_INTERVAL_MS/1000.0 - now;
+
+  if(wait > 0.0) {
+    if(!hover_timer_set) {
+      hover_timer_set = true;
+      glutTimerFunc((unsigned int)(wait*1000.0) + 1, hover_timer, 0);
     }
+    return;
+  }
+  hover_waiting = false;
+  hover_last_submit = now;
+  hover_event_time = hover_request.time;
+  hover_in_flight = true;
+  if(pick_mode == PICK_CPU || pick_mode == PICK_MULTI) {
+    hover_thread = std::thread(run_hover_pick, pick_mode, 
+                               make_ray(hover_request.origin, hover_request.dir));
+    glutTimerFunc(PICK_POLL_MS, poll_hover, 0);
+  }
+  else {
+    submit_pick(hover_request.origin, hover_request.dir, deliver_hover);
+  }
+}
 
-    // Check for smallest output
-    for(j=0; j<num_groups; j++) {
-      if(t_out[j] < t_test) {
-        t_test = t_out[j];
-        selected_object = i;
-      }
+// Ray down the z axis through the middle of the scene, used for tuning
+glm::vec4 tuning_origin, tuning_dir;
+
+// Run one scene pick with a candidate configuration for the autotuner
+void run_tuning_pick(const PickTuning& tuning) {
+
+  PendingPick pick;
+  cl_event done;
+
+  scene_group_size = tuning.group_size;
+  tris_per_item = tuning.tris_per_item;
+  pick.mode = PICK_SCENE;
+  pick.origin = tuning_origin;
+  pick.dir = tuning_dir;
+  enqueue_scene_pick(&pick, &done);
+  clWaitForEvents(1, &done);
+  clReleaseEvent(done);
+  collect_pick(pick);
+}
+
+// Choose the work-group size and triangles per work-item of the
+// triangle-parallel kernels. Only the scene kernel is timed on this device,
+// and the per-object and atomic kernels take its result, clamped to their
+// own work-group limits.
+void tune_pick_kernels() {
+
+  const std::vector<ObjectBounds>& bounds = pick_engine.bounds();
+  glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+  size_t max_size = scene_group_size;
+  PickTuning tuning;
+  bool profiling = pick_profiler.enabled();
+
+  if(num_scene_triangles == 0) {
+    return;
+  }
+  for(size_t i=0; i<bounds.size(); i++) {
+    lo = glm::min(lo, bounds[i].min);
+    hi = glm::max(hi, bounds[i].max);
+  }
+  tuning_origin = glm::vec4((lo.x + hi.x)/2, (lo.y + hi.y)/2, hi.z + 1.0f, 
+                            pick_engine.epsilon(pick_epsilon));
+  tuning_dir = glm::vec4(0.0f, 0.0f, -1.0f, (float)PICK_CULL_BACK);
+
+  // Make room for the results of the smallest work-groups
+  scene_group_size = 1;
+  tris_per_item = 1;
+  release_scene_buffers();
+  init_scene_buffers();
+
+  // Keep the candidates out of the profile
+  pick_profiler.setEnabled(false);
+  tuning = PickTuner::tune(device, scene_kernel, SCENE_KERNEL_FUNC, 
+                           program_options.c_str(), max_size, 
+                           num_scene_triangles, run_tuning_pick);
+  pick_profiler.setEnabled(profiling);
+
+  // Apply the result and resize the per-group buffers to match
+  scene_group_size = tuning.group_size;
+  max_group_size = std::min(max_group_size, tuning.group_size);
+  atomic_group_size = std::min(atomic_group_size, tuning.group_size);
+  tris_per_item = tuning.tris_per_item;
+  update_cl_buffers();
+}
+
+// Build a ray through a point in normalized device coordinates
+PickRay make_screen_ray(float x, float y) {
+
+  glm::vec4 origin = mvp_inverse * glm::vec4(x, y, -1.0f, 1.0f);
+  glm::vec4 dir = mvp_inverse * glm::vec4(0.0f, 0.0f, 1.0f, 0.0f);
+  PickRay ray;
+
+  ray.origin = glm::vec3(origin.x, origin.y, origin.z);
+  ray.dir = glm::normalize(glm::vec3(dir.x, dir.y, dir.z));
+  ray.cull = pick_cull;
+  ray.epsilon = pick_engine.epsilon(pick_epsilon);
+  return ray;
+}
+
+// Pick a grid of rays across the window and list the visible objects
+void pick_grid() {
+
+  std::vector<PickRay> rays;
+  std::vector<PickResult> results;
+  std::vector<bool> visible(num_objects, false);
+
+  for(int i=0; i<GRID_SIZE; i++) {
+    for(int j=0; j<GRID_SIZE; j++) {
+      rays.push_back(make_screen_ray((j + 0.5f)*2.0f/GRID_SIZE - 1.0f, 
+                                     (i + 0.5f)*2.0f/GRID_SIZE - 1.0f));
+    }
+  }
+  if(pick_mode == PICK_CPU) {
+    pick_engine.pickBatch(rays, &results);
+  }
+  else {
+    execute_batch_kernel(rays, &results);
+  }
+
+  for(size_t i=0; i<results.size(); i++) {
+    if(results[i].object != UINT_MAX) {
+      visible[results[i].object] = true;
+    }
+  }
+  std::cout << "Visible objects:";
+  for(unsigned int i=0; i<num_objects; i++) {
+    if(visible[i]) {
+      std::cout << " " << i;
     }
+  }
+  std::cout << std::endl;
+}
+
+// Respond to key presses
+void keyboard(unsigned char key, int x, int y) {
 
-    // Deallocate and release objects
-    delete(t_out);
-    clEnqueueReleaseGLObjects(queue, 1, &vbo_memobj, 0, NULL, NULL);
-    clEnqueueReleaseGLObjects(queue, 1, &ibo_memobj, 0, NULL, NULL);
-    clReleaseMemObject(vbo_memobj);
-    clReleaseMemObject(ibo_memobj);
-    clReleaseMemObject(t_out_buffer);
+  // Sample the window with a batch of rays
+  if(key == 'g') {
+    pick_grid();
   }
-  if(t_test == 1000) {
-    selected_object = UINT_MAX;
+
+  // Cycle through the picking strategies, skipping those the machine lacks
+  if(key == 'm') {
+    pick_mode = (PickMode)((pick_mode + 1) % NUM_PICK_MODES);
+    if(pick_mode == PICK_ATOMIC && atomic_kernel == NULL) {
+      pick_mode = (PickMode)((pick_mode + 1) % NUM_PICK_MODES);
+    }
+    if(pick_mode == PICK_MULTI && pick_scheduler.deviceCount() < 2) {
+      pick_mode = (PickMode)((pick_mode + 1) % NUM_PICK_MODES);
+    }
+    std::cout << "Picking mode: " << pick_mode_names[pick_mode] << std::endl;
   }
 
-  // Release lock on OpenGL objects and redisplay window
-  clFinish(queue);
-  glutPostRedisplay();
+  // Cycle through the faces picks ignore
+  if(key == 'c') {
+    pick_cull = (PickCull)((pick_cull + 1) % 3);
+    reset_pick_through();
+    std::cout << "Culling: " << pick_cull_names[pick_cull] << std::endl;
+  }
+
+  // Cycle through the pick-through modes
+  if(key == 't') {
+    through_mode = (ThroughMode)((through_mode + 1) % 3);
+    reset_pick_through();
+    std::cout << "Pick-through: " << through_mode_names[through_mode] << std::endl;
+  }
 
+  // Highlight the object under the pointer
+  if(key == 'h') {
+    hover_picking = !hover_picking;
+    hover_waiting = false;
+    hovered_object = UINT_MAX;
+    glutPostRedisplay();
+    std::cout << "Hover picking " << (hover_picking ? "on" : "off") << std::endl;
+  }
+
+  // Switch between queued and blocking picks
+  if(key == 'a') {
+    async_picking = !async_picking;
+    std::cout << (async_picking ? "Asynchronous" : "Blocking") << " picking" << std::endl;
+  }
+
+  // Print the latency of each pick stage
+  if(key == 'p') {
+    if(pick_profiler.enabled()) {
+      pick_profiler.dump(std::cout);
+    }
+    else {
+      std::cout << "Set PICK_PROFILE to profile picks" << std::endl;
+    }
+    if(hover_events > 0) {
+      std::cout << "Hover: " << hover_events << " motion events, " 
+                << hover_dropped << " replaced by newer events" << std::endl;
+    }
+  }
+}
+
+// Compute the kernel arguments of the ray through a window pixel, in
+// object coordinates
+void window_ray(int x, int y, glm::vec4* O, glm::vec4* D) {
+
+  glm::vec4 origin = mvp_inverse * glm::vec4(
+           (x-half_width)/half_width, (half_height-y)/half_height, -1.0f, 1.0f);
+  glm::vec4 dir = mvp_inverse * glm::vec4(0.0f, 0.0f, 1.0f, 0.0f);
+
+  *O = glm::vec4(origin.x, origin.y, origin.z, pick_engine.epsilon(pick_epsilon));
+  *D = glm::vec4(glm::normalize(glm::vec3(dir.x, dir.y, dir.z)), (float)pick_cull);
 }
 
 // Respond to mouse clicks
 void mouse(int button, int state, int x, int y) {
 
+  // Drag with the right button to select the objects in a rectangle
+  if(button == GLUT_RIGHT_BUTTON) {
+    if(state == GLUT_DOWN) {
+      marquee_active = true;
+      marquee_x = x;
+      marquee_y = y;
+    }
+    else if(marquee_active) {
+      marquee_active = false;
+      select_box(x, y);
+    }
+    return;
+  }
+
+  // Trace a lasso with the middle button to select the objects inside it
+  if(button == GLUT_MIDDLE_BUTTON) {
+    if(state == GLUT_DOWN) {
+      lasso_active = true;
+      lasso_points.assign(1, glm::vec2(x, y));
+    }
+    else if(lasso_active) {
+      lasso_active = false;
+      select_lasso();
+    }
+    return;
+  }
+
   if(state == GLUT_DOWN) {
 
     glm::vec3 K, L, M, E, F, G, ans;
+    glm::vec4 O, D;
 
     // Compute origin (O) and direction (D) in object coordinates
-    glm::vec4 origin = mvp_inverse * glm::vec4(
-             (x-half_width)/half_width, (half_height-y)/half_height, -1.0f, 1.0f);
-    glm::vec4 dir = mvp_inverse * glm::vec4(0.0f, 0.0f, 1.0f, 0.0f);
-    glm::vec4 O = glm::vec4(origin.x, origin.y, origin.z, 0.0f);
-    glm::vec4 D = glm::vec4(glm::normalize(glm::vec3(dir.x, dir.y, dir.z)), 0.0f);
-    execute_selection_kernel(O, D);
+    window_ray(x, y, &O, &D);
+    double start = PickProfiler::now();
+    if(through_mode != THROUGH_OFF) {
+      pick_through(x, y, O, D);
+      return;
+    }
+    if(pick_mode == PICK_CPU) {
+      set_pick_result(pick_engine.pick(make_ray(O, D)));
+    }
+    else if(pick_mode == PICK_MULTI) {
+      finish_hover_thread();
+      set_pick_result(pick_scheduler.pick(make_ray(O, D)));
+    }
+    else if(async_picking) {
+      submit_pick(O, D, set_pick_result);
+      return;
+    }
+    else {
+      execute_pick(O, D);
+    }
+
+    // Asynchronous picks are timed when they are delivered
+    pick_profiler.record(std::string(pick_mode_names[pick_mode]) + " pick", 
+                         PickProfiler::now() - start);
+  }
+}
+
+// Update the box selection as the right button drags, and extend the
+// lasso as the middle button drags
+void motion(int x, int y) {
+
+  glm::vec2 point(x, y);
+
+  if(marquee_active) {
+    select_box(x, y);
+  }
+  if(lasso_active && lasso_points.size() < MAX_LASSO_POINTS &&
+     glm::length(point - lasso_points.back()) >= LASSO_SPACING) {
+    lasso_points.push_back(point);
+  }
+}
+
+// Queue a hover pick as the pointer moves with no button pressed. Events
+// arriving while a pick is in flight replace the waiting one.
+void passive_motion(int x, int y) {
+
+  if(!hover_picking) {
+    return;
+  }
+  hover_events++;
+  if(hover_waiting) {
+    hover_dropped++;
+  }
+  window_ray(x, y, &hover_request.origin, &hover_request.dir);
+  hover_request.time = PickProfiler::now();
+  hover_waiting = true;
+  if(!hover_in_flight) {
+    issue_hover_pick();
   }
 }
 
 // Deallocate memory
 void deallocate() {
 
+  // Wait for a hover pick running off the GLUT thread
+  finish_hover_thread();
+
   // Deallocate mesh data
   ColladaInterface::freeGeometries(&geom_vec);
 
+  // Drop picks still on the queue
+  if(!pending_picks.empty()) {
+    clFinish(queue);
+    clReleaseEvent(pick_event);
+  }
+
   // Deallocate OpenCL resources
+  pick_scheduler.release();
+  release_cl_buffers();
+  release_kernel_variants();
+  if(atomic_kernel != NULL) {
+    clReleaseKernel(atomic_kernel);
+  }
+  clReleaseKernel(batch_kernel);
+  clReleaseKernel(sort_kernel);
+  clReleaseKernel(select_triangles_kernel);
+  clReleaseKernel(select_objects_kernel);
+  clReleaseKernel(lasso_kernel);
+  clReleaseKernel(nearest_kernel);
+  clReleaseKernel(all_hits_kernel);
+  clReleaseKernel(vector_kernel);
+  clReleaseKernel(precomputed_kernel);
+  clReleaseKernel(bvh_kernel);
+  clReleaseKernel(reduce_kernel);
+  clReleaseKernel(scene_kernel);
   clReleaseKernel(kernel);
   clReleaseCommandQueue(queue);
   clReleaseProgram(program);
@@ -546,17 +2772,28 @@ int main(int argc, char* argv[]) {
   // Initialize COLLADA geometries
   ColladaInterface::readGeometries(&geom_vec, "spheres.dae");
   num_objects = geom_vec.size();
+  pick_engine.setGeometries(&geom_vec);
+  if(getenv("PICK_TOLERANCE") != NULL) {
+    pick_epsilon = atof(getenv("PICK_TOLERANCE"));
+  }
+  pick_engine.setWatertight(getenv("PICK_WATERTIGHT") != NULL);
 
   // Start OpenGL processing
   init_gl(argc, argv);
 
   // Start OpenCL processing
   init_cl();
+  init_cl_buffers();
+  tune_pick_kernels();
+  pick_scheduler.init(&pick_engine, read_file(PROGRAM_FILE), program_options.c_str());
 
   // Set callback functions
   glutDisplayFunc(display);
   glutReshapeFunc(reshape);   
   glutMouseFunc(mouse);
+  glutMotionFunc(motion);
+  glutPassiveMotionFunc(passive_motion);
+  glutKeyboardFunc(keyboard);
  
   // Configure deallocation callback
   atexit(deallocate);
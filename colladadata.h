@@ -0,0 +1,35 @@
+#ifndef COLLADADATA_H
+#define COLLADADATA_H
+
+#include <map>
+#include <string>
+
+// OpenGL enums stored in SourceData::type and ColGeom::primitive. Their
+// values are fixed by the OpenGL specification, so the mesh data can be
+// used without OpenGL headers.
+#define COLLADA_LINES 0x0001           // GL_LINES
+#define COLLADA_LINE_STRIP 0x0003      // GL_LINE_STRIP
+#define COLLADA_TRIANGLES 0x0004       // GL_TRIANGLES
+#define COLLADA_TRIANGLE_STRIP 0x0005  // GL_TRIANGLE_STRIP
+#define COLLADA_TRIANGLE_FAN 0x0006    // GL_TRIANGLE_FAN
+#define COLLADA_INT 0x1404             // GL_INT
+#define COLLADA_FLOAT 0x1406           // GL_FLOAT
+
+struct SourceData {
+  unsigned int type;
+  unsigned int size;
+  unsigned int stride;
+  void* data;
+};
+
+typedef std::map<std::string, SourceData> SourceMap;
+
+struct ColGeom {
+  std::string name;
+  SourceMap map;
+  unsigned int primitive;
+  int index_count;
+  unsigned short* indices;
+};
+
+#endif
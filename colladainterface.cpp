@@ -1,11 +1,29 @@
 #include "colladainterface.h"
 
+// OpenCL CPU devices can use host arrays in place if they start on a
+// page boundary and fill whole cache lines
+#define DATA_ALIGNMENT 4096
+#define DATA_SIZE_MULTIPLE 64
+
 char array_types[7][15] = {"float_array", "int_array", "bool_array", "Name_array", 
                            "IDREF_array", "SIDREF_array", "token_array"};
 
 char primitive_types[7][15] = {"lines", "linestrips", "polygons", "polylist", 
                                "triangles", "trifans", "tristrips"};
 
+// Allocate an aligned array that can be released with free()
+static void* aligned_malloc(size_t size) {
+
+  void* ptr;
+
+  size = (size + DATA_SIZE_MULTIPLE - 1)/DATA_SIZE_MULTIPLE * DATA_SIZE_MULTIPLE;
+  if(posix_memalign(&ptr, DATA_ALIGNMENT, size) != 0) {
+    std::cerr << "Couldn't allocate " << size << " bytes" << std::endl;
+    exit(1);
+  }
+  return ptr;
+}
+
 void ColladaInterface::readGeometries(std::vector<ColGeom>* v, const char* filename) {
 
   TiXmlElement *mesh, *vertices, *input, *source, *primitive;
@@ -62,23 +80,23 @@ void ColladaInterface::readGeometries(std::vector<ColGeom>* v, const char* filen
           // Determine primitive type and set count
           switch(i) {
             case 0:
-              data.primitive = GL_LINES; 
+              data.primitive = COLLADA_LINES; 
               num_indices = prim_count * 2; 
             break;
             case 1: 
-              data.primitive = GL_LINE_STRIP; 
+              data.primitive = COLLADA_LINE_STRIP; 
               num_indices = prim_count + 1;
             break;
             case 4: 
-              data.primitive = GL_TRIANGLES; 
+              data.primitive = COLLADA_TRIANGLES; 
               num_indices = prim_count * 3; 
             break;
             case 5: 
-              data.primitive = GL_TRIANGLE_FAN; 
+              data.primitive = COLLADA_TRIANGLE_FAN; 
               num_indices = prim_count + 2; 
             break;
             case 6: 
-              data.primitive = GL_TRIANGLE_STRIP; 
+              data.primitive = COLLADA_TRIANGLE_STRIP; 
               num_indices = prim_count + 2; 
             break;
             default: std::cout << "Primitive " << primitive_types[i] << 
@@ -87,7 +105,7 @@ void ColladaInterface::readGeometries(std::vector<ColGeom>* v, const char* filen
           data.index_count = num_indices;
 
           // Allocate memory for indices
-          data.indices = (unsigned short*)malloc(num_indices * sizeof(unsigned short));
+          data.indices = (unsigned short*)aligned_malloc(num_indices * sizeof(unsigned short));
 
           // Read the index values
           char* text = (char*)(primitive->FirstChildElement("p")->GetText());
@@ -158,9 +176,9 @@ SourceData readSource(TiXmlElement* source) {
 
         // Array of floats
         case 0:
-          source_data.type = GL_FLOAT;
+          source_data.type = COLLADA_FLOAT;
           source_data.size *= sizeof(float);
-          source_data.data = malloc(num_vals * sizeof(float));
+          source_data.data = aligned_malloc(num_vals * sizeof(float));
 
           // Read the float values
           ((float*)source_data.data)[0] = atof(strtok(text, " "));  
@@ -171,9 +189,9 @@ SourceData readSource(TiXmlElement* source) {
 
         // Array of integers
         case 1:
-          source_data.type = GL_INT;
+          source_data.type = COLLADA_INT;
           source_data.size *= sizeof(int);
-          source_data.data = malloc(num_vals * sizeof(int));
+          source_data.data = aligned_malloc(num_vals * sizeof(int));
 
           // Read the int values
           ((int*)source_data.data)[0] = atof(strtok(text, " "));  
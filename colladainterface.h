@@ -7,25 +7,9 @@
 #include <sstream>
 #include <iterator>
 
-#include "GL3/gl3.h"
 #include "tinyxml/tinyxml.h"
 
-struct SourceData {
-  GLenum type;
-  unsigned int size;
-  unsigned int stride;
-  void* data;
-};
-
-typedef std::map<std::string, SourceData> SourceMap;
-
-struct ColGeom {
-  std::string name;
-  SourceMap map;
-  GLenum primitive;
-  int index_count;
-  unsigned short* indices;
-};
+#include "colladadata.h"
 
 SourceData readSource(TiXmlElement*);
 
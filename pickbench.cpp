@@ -0,0 +1,231 @@
+#define DEFAULT_SCENE "spheres.dae"
+#define NUM_RAYS 20000
+#define NUM_RUNS 5
+#define MATCH_TOLERANCE 1e-5f    // Largest relative difference of matching hits
+
+// Compare the default and watertight triangle tests of the pick engine,
+// and check its picks. Exits with 1 if an accelerated pick differs from
+// a brute-force pick, or if a watertight pick misses an edge or vertex.
+// Usage: pick_bench [file.dae]
+
+#include "colladainterface.h"
+#include "pickengine.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Rays from outside the scene toward random points inside random triangles
+void make_interior_rays(const PickEngine& engine, std::vector<PickRay>* rays) {
+
+  const std::vector<float>& pos = engine.positions();
+  const std::vector<unsigned int>& ind = engine.indices();
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<unsigned int> pick_tri(0, engine.triangleCount() - 1);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+  std::normal_distribution<float> normal;
+  glm::vec3 lo(FLT_MAX), hi(-FLT_MAX), center, target, v[3], away;
+  float radius, a, b;
+  unsigned int tri;
+  PickRay ray;
+
+  for(size_t i=0; i<engine.bounds().size(); i++) {
+    lo = glm::min(lo, engine.bounds()[i].min);
+    hi = glm::max(hi, engine.bounds()[i].max);
+  }
+  center = (lo + hi) * 0.5f;
+  radius = glm::length(hi - lo);
+
+  for(unsigned int i=0; i<NUM_RAYS; i++) {
+    tri = pick_tri(rng);
+    for(int j=0; j<3; j++) {
+      v[j] = glm::vec3(pos[3*ind[3*tri+j]], pos[3*ind[3*tri+j]+1], pos[3*ind[3*tri+j]+2]);
+    }
+    a = unit(rng);
+    b = unit(rng);
+    if(a + b > 1.0f) {
+      a = 1.0f - a;
+      b = 1.0f - b;
+    }
+    target = v[0] + a*(v[1] - v[0]) + b*(v[2] - v[0]);
+    away = glm::normalize(glm::vec3(normal(rng), normal(rng), normal(rng)));
+    ray.origin = center + away * radius;
+    ray.dir = glm::normalize(target - ray.origin);
+    ray.epsilon = engine.epsilon(PICK_RELATIVE_EPSILON);
+    rays->push_back(ray);
+  }
+}
+
+// Rays aimed at every vertex and edge midpoint from outside its object.
+// On closed convex meshes like the spheres, every one of them should hit.
+void make_edge_rays(const PickEngine& engine, std::vector<PickRay>* rays) {
+
+  const std::vector<float>& pos = engine.positions();
+  const std::vector<unsigned int>& ind = engine.indices();
+  glm::vec3 v[3], targets[6], outward;
+  PickRay ray;
+
+  for(unsigned int tri=0; tri<engine.triangleCount(); tri++) {
+    const ObjectBounds& bounds = engine.bounds()[engine.triangleObject(tri)];
+    for(int j=0; j<3; j++) {
+      v[j] = glm::vec3(pos[3*ind[3*tri+j]], pos[3*ind[3*tri+j]+1], pos[3*ind[3*tri+j]+2]);
+    }
+    for(int j=0; j<3; j++) {
+      targets[j] = v[j];
+      targets[3+j] = (v[j] + v[(j+1)%3]) * 0.5f;
+    }
+    for(int j=0; j<6; j++) {
+      outward = targets[j] - bounds.center;
+      if(glm::length(outward) == 0.0f) {
+        continue;
+      }
+      outward = glm::normalize(outward);
+      ray.origin = targets[j] + outward * bounds.radius;
+      ray.dir = -outward;
+      ray.epsilon = engine.epsilon(PICK_RELATIVE_EPSILON);
+      rays->push_back(ray);
+    }
+  }
+}
+
+// Best time per ray over several runs, in nanoseconds
+double time_picks(const PickEngine& engine, const std::vector<PickRay>& rays) {
+
+  double best = DBL_MAX, seconds;
+  std::chrono::steady_clock::time_point start;
+
+  for(int run=0; run<NUM_RUNS; run++) {
+    start = std::chrono::steady_clock::now();
+    for(size_t i=0; i<rays.size(); i++) {
+      engine.pick(rays[i]);
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    best = std::min(best, seconds);
+  }
+  return best / rays.size() * 1e9;
+}
+
+// Nearest hit found by testing every triangle of the scene with the
+// engine's current triangle test
+PickResult brute_force_pick(const PickEngine& engine, const PickRay& ray) {
+
+  const std::vector<float>& pos = engine.positions();
+  const std::vector<unsigned int>& ind = engine.indices();
+  const float *k, *l, *m;
+  float t, t_best = PICK_MISS;
+  unsigned int best = UINT_MAX;
+
+  for(unsigned int tri=0; tri<engine.triangleCount(); tri++) {
+    k = &pos[3*ind[3*tri]];
+    l = &pos[3*ind[3*tri+1]];
+    m = &pos[3*ind[3*tri+2]];
+    t = engine.isWatertight() ? 
+        PickEngine::intersectWatertight(ray.origin, ray.dir, k, l, m, ray.cull, ray.epsilon) :
+        PickEngine::intersectTriangle(ray.origin, ray.dir, k, l, m, ray.cull, ray.epsilon);
+    if(t < t_best) {
+      t_best = t;
+      best = tri;
+    }
+  }
+  return engine.makeResult(best, t_best, ray);
+}
+
+// Count the picks that differ from the brute-force picks in reference.
+// Triangles meeting at an edge or vertex give hits whose distances differ
+// by rounding, so a pick may settle on any of them.
+unsigned int count_mismatches(const PickEngine& engine, const std::vector<PickRay>& rays,
+                              const std::vector<PickResult>& reference) {
+
+  unsigned int mismatches = 0;
+  PickResult result;
+
+  for(size_t i=0; i<rays.size(); i++) {
+    result = engine.pick(rays[i]);
+    if((result.object == UINT_MAX) != (reference[i].object == UINT_MAX) ||
+       (result.object != UINT_MAX && 
+        std::fabs(result.t - reference[i].t) > MATCH_TOLERANCE * reference[i].t)) {
+      mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+unsigned int count_misses(const PickEngine& engine, const std::vector<PickRay>& rays) {
+
+  unsigned int misses = 0;
+
+  for(size_t i=0; i<rays.size(); i++) {
+    if(engine.pick(rays[i]).object == UINT_MAX) {
+      misses++;
+    }
+  }
+  return misses;
+}
+
+int main(int argc, char* argv[]) {
+
+  std::vector<ColGeom> geom_vec;
+  std::vector<PickRay> interior_rays, edge_rays, all_rays;
+  std::vector<PickResult> reference[2];
+  unsigned int misses, mismatches;
+  bool failed = false;
+  PickEngine engine;
+
+  ColladaInterface::readGeometries(&geom_vec, (argc > 1) ? argv[1] : DEFAULT_SCENE);
+  engine.setGeometries(&geom_vec);
+  engine.setThreadCount(1);
+  if(engine.triangleCount() == 0) {
+    std::cerr << "The scene has no triangles" << std::endl;
+    return 1;
+  }
+  make_interior_rays(engine, &interior_rays);
+  make_edge_rays(engine, &edge_rays);
+
+  // Pick every ray by brute force with each test
+  all_rays = interior_rays;
+  all_rays.insert(all_rays.end(), edge_rays.begin(), edge_rays.end());
+  for(int watertight=0; watertight<2; watertight++) {
+    engine.setWatertight(watertight);
+    for(size_t i=0; i<all_rays.size(); i++) {
+      reference[watertight].push_back(brute_force_pick(engine, all_rays[i]));
+    }
+  }
+
+  std::cout << engine.triangleCount() << " triangles, " << interior_rays.size()
+            << " interior rays, " << edge_rays.size() << " edge and vertex rays" << std::endl;
+  std::cout << std::left << std::setw(14) << "Test" << std::setw(8) << "Accel" << std::right
+            << std::setw(12) << "ns/ray" << std::setw(14) << "Edge misses" 
+            << std::setw(14) << "Mismatches" << std::endl;
+  for(int accelerate=1; accelerate>=0; accelerate--) {
+    engine.setAcceleration(accelerate);
+    for(int watertight=0; watertight<2; watertight++) {
+      engine.setWatertight(watertight);
+      misses = count_misses(engine, edge_rays);
+      mismatches = count_mismatches(engine, all_rays, reference[watertight]);
+      std::cout << std::left << std::setw(14) << (watertight ? "watertight" : "default")
+                << std::setw(8) << (accelerate ? "BVH" : "scan") << std::right
+                << std::fixed << std::setprecision(1)
+                << std::setw(12) << time_picks(engine, interior_rays)
+                << std::setw(14) << misses << std::setw(14) << mismatches << std::endl;
+      if(mismatches > 0) {
+        std::cerr << (watertight ? "Watertight" : "Default") << " picks with " 
+                  << (accelerate ? "the BVH" : "object scans") 
+                  << " differ from brute-force picks" << std::endl;
+        failed = true;
+      }
+      if(watertight && misses > 0) {
+        std::cerr << "Watertight picks with " << (accelerate ? "the BVH" : "object scans") 
+                  << " missed edges or vertices" << std::endl;
+        failed = true;
+      }
+    }
+  }
+
+  ColladaInterface::freeGeometries(&geom_vec);
+  return failed ? 1 : 0;
+}
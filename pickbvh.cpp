@@ -0,0 +1,281 @@
+#include "pickbvh.h"
+#include "pickengine.h"
+
+#include <algorithm>
+#include <cfloat>
+
+#define NUM_BINS 16
+#define MAX_LEAF_SIZE 8
+#define STACK_SIZE 64
+#define MAX_DEPTH (STACK_SIZE - 1)
+#define BOX_TOLERANCE 1.0000004f
+#define MIN_DIRECTION 1e-20f
+
+// Surface area of the box between lo and hi
+static float area(const glm::vec3& lo, const glm::vec3& hi) {
+  glm::vec3 d = hi - lo;
+  return 2.0f * (d.x*d.y + d.y*d.z + d.z*d.x);
+}
+
+void PickBVH::clear() {
+  bvh_nodes.clear();
+  tri_order.clear();
+}
+
+// Build the hierarchy over an array holding nine floats per triangle.
+// The array must outlive the BVH, since leaves are tested against it.
+void PickBVH::build(const std::vector<float>& vertices) {
+
+  unsigned int num_tris = vertices.size()/9;
+  glm::vec3 K, L, M;
+
+  clear();
+  if(num_tris == 0) {
+    return;
+  }
+  tri_vertices = &vertices[0];
+
+  // Compute the bounds and centroid of every triangle
+  tri_min.resize(num_tris);
+  tri_max.resize(num_tris);
+  tri_center.resize(num_tris);
+  tri_order.resize(num_tris);
+  for(unsigned int i=0; i<num_tris; i++) {
+    K = glm::vec3(vertices[9*i], vertices[9*i+1], vertices[9*i+2]);
+    L = glm::vec3(vertices[9*i+3], vertices[9*i+4], vertices[9*i+5]);
+    M = glm::vec3(vertices[9*i+6], vertices[9*i+7], vertices[9*i+8]);
+    tri_min[i] = glm::min(K, glm::min(L, M));
+    tri_max[i] = glm::max(K, glm::max(L, M));
+    tri_center[i] = (tri_min[i] + tri_max[i]) * 0.5f;
+    tri_order[i] = i;
+  }
+
+  bvh_nodes.reserve(2 * num_tris / MAX_LEAF_SIZE + 1);
+  buildNode(0, num_tris, 0);
+
+  // The per-triangle bounds are only needed while building
+  std::vector<glm::vec3>().swap(tri_min);
+  std::vector<glm::vec3>().swap(tri_max);
+  std::vector<glm::vec3>().swap(tri_center);
+}
+
+// Create the node for tri_order[start, start+count) and its subtree. Past
+// MAX_DEPTH the node becomes a leaf, so traversal stacks never overflow.
+unsigned int PickBVH::buildNode(unsigned int start, unsigned int count,
+                                unsigned int depth) {
+
+  glm::vec3 lo(FLT_MAX), hi(-FLT_MAX), c_lo(FLT_MAX), c_hi(-FLT_MAX);
+  glm::vec3 bin_lo[NUM_BINS], bin_hi[NUM_BINS], right_lo, right_hi;
+  unsigned int bin_count[NUM_BINS], right_count[NUM_BINS];
+  float right_area[NUM_BINS], cost, best_cost, scale;
+  unsigned int node_index, tri, mid, left_count, right;
+  int axis, best_axis = -1, best_split = 0, bin;
+  BVHNode node;
+
+  // Compute the bounds of the triangles and of their centroids
+  for(unsigned int i=start; i<start+count; i++) {
+    tri = tri_order[i];
+    lo = glm::min(lo, tri_min[tri]);
+    hi = glm::max(hi, tri_max[tri]);
+    c_lo = glm::min(c_lo, tri_center[tri]);
+    c_hi = glm::max(c_hi, tri_center[tri]);
+  }
+  for(int j=0; j<3; j++) {
+    node.bounds_min[j] = lo[j];
+    node.bounds_max[j] = hi[j];
+  }
+  node_index = bvh_nodes.size();
+  bvh_nodes.push_back(node);
+
+  // Evaluate the SAH cost of splitting at each bin boundary of each axis
+  best_cost = area(lo, hi) * count;
+  for(axis=0; axis<3 && count > 1 && depth < MAX_DEPTH; axis++) {
+    if(c_hi[axis] <= c_lo[axis]) {
+      continue;
+    }
+    scale = NUM_BINS / (c_hi[axis] - c_lo[axis]);
+
+    // Place the triangles in bins
+    for(int b=0; b<NUM_BINS; b++) {
+      bin_lo[b] = glm::vec3(FLT_MAX);
+      bin_hi[b] = glm::vec3(-FLT_MAX);
+      bin_count[b] = 0;
+    }
+    for(unsigned int i=start; i<start+count; i++) {
+      tri = tri_order[i];
+      bin = std::min((int)((tri_center[tri][axis] - c_lo[axis]) * scale), NUM_BINS-1);
+      bin_lo[bin] = glm::min(bin_lo[bin], tri_min[tri]);
+      bin_hi[bin] = glm::max(bin_hi[bin], tri_max[tri]);
+      bin_count[bin]++;
+    }
+
+    // Sweep from the right to accumulate the right-hand areas and counts
+    right_lo = glm::vec3(FLT_MAX);
+    right_hi = glm::vec3(-FLT_MAX);
+    right_count[NUM_BINS-1] = 0;
+    for(int b=NUM_BINS-1; b>0; b--) {
+      right_lo = glm::min(right_lo, bin_lo[b]);
+      right_hi = glm::max(right_hi, bin_hi[b]);
+      right_count[b-1] = right_count[b] + bin_count[b];
+      right_area[b-1] = area(right_lo, right_hi);
+    }
+
+    // Sweep from the left and compare the cost of each split
+    lo = glm::vec3(FLT_MAX);
+    hi = glm::vec3(-FLT_MAX);
+    left_count = 0;
+    for(int b=0; b<NUM_BINS-1; b++) {
+      lo = glm::min(lo, bin_lo[b]);
+      hi = glm::max(hi, bin_hi[b]);
+      left_count += bin_count[b];
+      if(left_count == 0 || right_count[b] == 0) {
+        continue;
+      }
+      cost = area(lo, hi) * left_count + right_area[b] * right_count[b];
+      if(cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = b;
+      }
+    }
+  }
+
+  // Make a leaf if no split is cheaper and the leaf is small enough
+  if(best_axis < 0 && (count <= MAX_LEAF_SIZE || depth >= MAX_DEPTH)) {
+    bvh_nodes[node_index].first = start;
+    bvh_nodes[node_index].count = count;
+    return node_index;
+  }
+
+  // Partition the triangles, or halve them if their centroids coincide
+  if(best_axis >= 0) {
+    scale = NUM_BINS / (c_hi[best_axis] - c_lo[best_axis]);
+    mid = std::partition(tri_order.begin() + start, tri_order.begin() + start + count,
+      [&](unsigned int t) {
+        return std::min((int)((tri_center[t][best_axis] - c_lo[best_axis]) * scale),
+                        NUM_BINS-1) <= best_split;
+      }) - tri_order.begin();
+  }
+  else {
+    mid = start + count/2;
+  }
+
+  // Build the left child next to this node, then the right child. The
+  // children may reallocate the nodes, so the right child's index is
+  // stored only after it has been built.
+  buildNode(start, mid - start, depth + 1);
+  right = buildNode(mid, start + count - mid, depth + 1);
+  bvh_nodes[node_index].first = right;
+  bvh_nodes[node_index].count = 0;
+  return node_index;
+}
+
+// Reciprocal of the direction, with zero components replaced by a tiny
+// value of the same sign. An infinite reciprocal would make the slab test
+// compute 0 * inf = NaN for rays lying in the plane of a box face, so the
+// slab test handles those components itself.
+glm::vec3 PickBVH::inverseDirection(const glm::vec3& D) {
+
+  glm::vec3 inv_dir;
+
+  for(int j=0; j<3; j++) {
+    inv_dir[j] = 1.0f / (std::fabs(D[j]) > MIN_DIRECTION ? D[j] : 
+                         std::copysign(MIN_DIRECTION, D[j]));
+  }
+  return inv_dir;
+}
+
+// Slab test returning the distance at which the ray enters the box, or -1
+// if it misses the box or only enters it beyond t_max. The exit distance
+// is widened by the rounding error of the slab arithmetic (Ize, "Robust
+// BVH Ray Traversal"), so rays through a vertex or edge on the box's
+// surface aren't rejected before their triangles are tested.
+float PickBVH::intersectBox(const glm::vec3& O, const glm::vec3& inv_dir,
+                            const float* lo, const float* hi, float t_max) {
+
+  float t_enter = 0.0f, t_exit = t_max, t0, t1;
+
+  for(int j=0; j<3; j++) {
+
+    // A ray parallel to a slab is inside it everywhere or nowhere. Rays
+    // in the plane of a face are inside, as they can hit its triangles.
+    if(std::fabs(inv_dir[j]) >= 1.0f/MIN_DIRECTION) {
+      if(O[j] < lo[j] || O[j] > hi[j]) {
+        return -1.0f;
+      }
+      continue;
+    }
+    t0 = (lo[j] - O[j]) * inv_dir[j];
+    t1 = (hi[j] - O[j]) * inv_dir[j];
+    t_enter = std::fmax(t_enter, std::fmin(t0, t1));
+    t_exit = std::fmin(t_exit, std::fmax(t0, t1) * BOX_TOLERANCE);
+  }
+  return (t_enter <= t_exit) ? t_enter : -1.0f;
+}
+
+// Traverse the hierarchy, visiting the nearer child of each node first and
+// skipping subtrees that start beyond the nearest hit found so far
+float PickBVH::intersect(const PickRay& ray, TriangleTest test, 
+                         unsigned int* triangle) const {
+
+  const glm::vec3& O = ray.origin;
+  const glm::vec3& D = ray.dir;
+  unsigned int stack[STACK_SIZE], stack_size = 0, index = 0, near_child, far_child;
+  float stack_t[STACK_SIZE], t_best = PICK_MISS, t, t_near, t_far;
+  glm::vec3 inv_dir = inverseDirection(D);
+  const float* tri;
+
+  *triangle = UINT_MAX;
+  if(bvh_nodes.empty() ||
+     intersectBox(O, inv_dir, bvh_nodes[0].bounds_min, bvh_nodes[0].bounds_max, t_best) < 0.0f) {
+    return t_best;
+  }
+
+  while(true) {
+    const BVHNode& node = bvh_nodes[index];
+
+    // Test the triangles of a leaf
+    if(node.count > 0) {
+      for(unsigned int i=node.first; i<node.first+node.count; i++) {
+        tri = &tri_vertices[9*tri_order[i]];
+        t = test(O, D, tri, tri+3, tri+6, ray.cull, ray.epsilon);
+        if(t < t_best) {
+          t_best = t;
+          *triangle = tri_order[i];
+        }
+      }
+    }
+
+    // Order the children of an interior node by entry distance
+    else {
+      near_child = index + 1;
+      far_child = node.first;
+      t_near = intersectBox(O, inv_dir, bvh_nodes[near_child].bounds_min,
+                            bvh_nodes[near_child].bounds_max, t_best);
+      t_far = intersectBox(O, inv_dir, bvh_nodes[far_child].bounds_min,
+                           bvh_nodes[far_child].bounds_max, t_best);
+      if(t_far >= 0.0f && (t_near < 0.0f || t_far < t_near)) {
+        std::swap(near_child, far_child);
+        std::swap(t_near, t_far);
+      }
+      if(t_near >= 0.0f) {
+        if(t_far >= 0.0f) {
+          stack[stack_size] = far_child;
+          stack_t[stack_size++] = t_far;
+        }
+        index = near_child;
+        continue;
+      }
+    }
+
+    // Pop the next subtree that starts before the nearest hit
+    do {
+      if(stack_size == 0) {
+        return t_best;
+      }
+      stack_size--;
+    } while(stack_t[stack_size] >= t_best);
+    index = stack[stack_size];
+  }
+  return t_best;
+}
@@ -0,0 +1,60 @@
+#ifndef PICKBVH_H
+#define PICKBVH_H
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+struct PickRay;
+enum PickCull : int;
+
+// Ray-triangle test returning the distance to a hit or PICK_MISS. The
+// arguments are the ray origin and direction, the three vertices, the
+// cull mode and the tolerance.
+typedef float (*TriangleTest)(const glm::vec3&, const glm::vec3&, const float*,
+                              const float*, const float*, PickCull, float);
+
+// Node of a flattened BVH, laid out as two float4 values so the OpenCL
+// kernel can read it directly. Nodes are stored depth-first, so the left
+// child of an interior node always follows its parent.
+struct BVHNode {
+  float bounds_min[3];
+  unsigned int first;     // First entry in the triangle order for leaves,
+                          // index of the right child for interior nodes
+  float bounds_max[3];
+  unsigned int count;     // Number of triangles in leaves, 0 for interior nodes
+};
+
+// Bounding volume hierarchy over the triangles of a packed scene, built
+// with a binned surface area heuristic
+class PickBVH {
+
+public:
+  PickBVH() {};
+  void build(const std::vector<float>&);
+  void clear();
+
+  // Find the nearest triangle hit by the ray, visiting near children first
+  float intersect(const PickRay&, TriangleTest, unsigned int*) const;
+
+  // Reciprocal of a ray direction for intersectBox()
+  static glm::vec3 inverseDirection(const glm::vec3&);
+
+  // Entry distance of a ray into a box, or -1 if the ray misses it
+  static float intersectBox(const glm::vec3&, const glm::vec3&,
+                            const float*, const float*, float);
+
+  const std::vector<BVHNode>& nodes() const { return bvh_nodes; }
+  const std::vector<unsigned int>& triangleOrder() const { return tri_order; }
+  bool empty() const { return bvh_nodes.empty(); }
+
+private:
+  unsigned int buildNode(unsigned int, unsigned int, unsigned int);
+
+  std::vector<BVHNode> bvh_nodes;
+  std::vector<unsigned int> tri_order;    // Triangles sorted into leaves
+  std::vector<glm::vec3> tri_min, tri_max, tri_center;
+  const float* tri_vertices;              // Nine floats per triangle
+};
+
+#endif
@@ -0,0 +1,631 @@
+#include "pickengine.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <thread>
+
+// Scenes smaller than this per thread are scanned on fewer threads
+#define MIN_TRIANGLES_PER_THREAD 16384
+
+PickEngine::PickEngine() {
+  num_threads = std::max(1u, std::thread::hardware_concurrency());
+  accelerate = true;
+  watertight = false;
+  scene_scale = 1.0f;
+}
+
+void PickEngine::setThreadCount(unsigned int count) {
+  num_threads = std::max(1u, count);
+}
+
+// Enable or disable the BVH, building it if needed
+void PickEngine::setAcceleration(bool enable) {
+  accelerate = enable;
+  if(accelerate && scene_bvh.empty()) {
+    scene_bvh.build(triangle_vertices);
+  }
+  else if(!accelerate) {
+    scene_bvh.clear();
+  }
+}
+
+void PickEngine::setGeometries(std::vector<ColGeom>* v) {
+
+  unsigned int base = 0, num_vertices, stride, index;
+  ObjectBounds b;
+  glm::vec3 p, scene_min(FLT_MAX), scene_max(-FLT_MAX);
+  float* data;
+
+  scene_positions.clear();
+  scene_indices.clear();
+  first_triangle.clear();
+  first_vertex.clear();
+  object_bounds.clear();
+  triangle_vertices.clear();
+
+  for(std::vector<ColGeom>::iterator geom_it = v->begin(); geom_it < v->end(); geom_it++) {
+
+    // Append the vertex coordinates
+    SourceData& pos = geom_it->map["POSITION"];
+    data = (float*)pos.data;
+    stride = pos.stride;
+    num_vertices = pos.size/(stride * sizeof(float));
+    for(unsigned int i=0; i<num_vertices; i++) {
+      scene_positions.push_back(data[i*stride]);
+      scene_positions.push_back(data[i*stride+1]);
+      scene_positions.push_back(data[i*stride+2]);
+    }
+
+    // Append the indices, offset by the vertices already in the scene
+    first_vertex.push_back(base);
+    first_triangle.push_back(scene_indices.size()/3);
+    for(int i=0; i<geom_it->index_count/3*3; i++) {
+      scene_indices.push_back(base + geom_it->indices[i]);
+    }
+
+    // Compute the object's box, then a sphere around the box
+    b.min = glm::vec3(FLT_MAX);
+    b.max = glm::vec3(-FLT_MAX);
+    for(unsigned int i=base; i<base+num_vertices; i++) {
+      p = glm::vec3(scene_positions[3*i], scene_positions[3*i+1], scene_positions[3*i+2]);
+      b.min = glm::min(b.min, p);
+      b.max = glm::max(b.max, p);
+    }
+    b.center = (b.min + b.max) * 0.5f;
+    b.radius = glm::length(b.max - b.center);
+    object_bounds.push_back(b);
+    base += num_vertices;
+    scene_min = glm::min(scene_min, b.min);
+    scene_max = glm::max(scene_max, b.max);
+  }
+
+  // Measure the scene for tolerances given relative to its size
+  scene_scale = (base > 0) ? glm::length(scene_max - scene_min) : 0.0f;
+  if(scene_scale <= 0.0f) {
+    scene_scale = 1.0f;
+  }
+
+  // Store the vertices of each triangle contiguously for the CPU scan
+  triangle_vertices.resize(scene_indices.size() * 3);
+  for(unsigned int i=0; i<scene_indices.size(); i++) {
+    index = scene_indices[i];
+    triangle_vertices[3*i] = scene_positions[3*index];
+    triangle_vertices[3*i+1] = scene_positions[3*index+1];
+    triangle_vertices[3*i+2] = scene_positions[3*index+2];
+  }
+
+  scene_bvh.clear();
+  if(accelerate) {
+    scene_bvh.build(triangle_vertices);
+  }
+}
+
+// Same test as intersect_triangle() in clgl_pick_selection.cl. Faces hit
+// from behind have their determinant, k and l negated, so the same tests
+// apply to both sides.
+float PickEngine::intersectTriangle(const glm::vec3& O, const glm::vec3& D,
+                                    const float* k_vert, const float* l_vert,
+                                    const float* m_vert, PickCull cull,
+                                    float epsilon) {
+
+  glm::vec3 M(m_vert[0], m_vert[1], m_vert[2]);
+  glm::vec3 E = glm::vec3(k_vert[0], k_vert[1], k_vert[2]) - M;
+  glm::vec3 F = glm::vec3(l_vert[0], l_vert[1], l_vert[2]) - M;
+  glm::vec3 P, G, Q;
+  float det, side, k, l, t;
+
+  // Compute and test determinant
+  P = glm::cross(D, F);
+  det = glm::dot(P, E);
+  if(cull == PICK_CULL_NONE) {
+    side = (det < 0.0f) ? -1.0f : 1.0f;
+  }
+  else {
+    side = (cull == PICK_CULL_FRONT) ? -1.0f : 1.0f;
+  }
+  if(det * side <= epsilon * epsilon) {
+    return PICK_MISS;
+  }
+
+  // Compute and test k
+  G = O - M;
+  k = glm::dot(P, G) * side;
+  if(k <= 0.0f || k > det * side) {
+    return PICK_MISS;
+  }
+
+  // Compute and test l
+  Q = glm::cross(G, E);
+  l = glm::dot(Q, D) * side;
+  if(l <= 0.0f || k + l > det * side) {
+    return PICK_MISS;
+  }
+
+  // Compute distance from ray to triangle
+  t = glm::dot(Q, F)/det;
+  return (t > epsilon) ? t : PICK_MISS;
+}
+
+// Watertight test of Woop, Benthin and Wald, as intersect_triangle() with
+// PICK_WATERTIGHT. The vertices are translated to the ray origin and
+// sheared so the ray runs along z, and the signs of the edge functions
+// U, V and W decide the hit. Edges and vertices are tested inclusively
+// and every triangle sharing an edge evaluates it identically, so a ray
+// can't pass between them.
+float PickEngine::intersectWatertight(const glm::vec3& O, const glm::vec3& D,
+                                      const float* k_vert, const float* l_vert,
+                                      const float* m_vert, PickCull cull,
+                                      float epsilon) {
+
+  glm::vec3 A, B, C;
+  float Sx, Sy, Sz, Ax, Ay, Bx, By, Cx, Cy, U, V, W, det, side, t;
+  int kx, ky, kz;
+
+  // Make the dominant axis of the direction z, swapping x and y to keep
+  // the winding when the ray points down that axis
+  kz = (std::fabs(D.x) > std::fabs(D.y)) ? ((std::fabs(D.x) > std::fabs(D.z)) ? 0 : 2) : 
+                                           ((std::fabs(D.y) > std::fabs(D.z)) ? 1 : 2);
+  kx = (kz + 1) % 3;
+  ky = (kx + 1) % 3;
+  if(D[kz] < 0.0f) {
+    std::swap(kx, ky);
+  }
+  Sx = D[kx]/D[kz];
+  Sy = D[ky]/D[kz];
+  Sz = 1.0f/D[kz];
+
+  // Translate and shear the vertices
+  A = glm::vec3(k_vert[0], k_vert[1], k_vert[2]) - O;
+  B = glm::vec3(l_vert[0], l_vert[1], l_vert[2]) - O;
+  C = glm::vec3(m_vert[0], m_vert[1], m_vert[2]) - O;
+  Ax = A[kx] - Sx*A[kz];
+  Ay = A[ky] - Sy*A[kz];
+  Bx = B[kx] - Sx*B[kz];
+  By = B[ky] - Sy*B[kz];
+  Cx = C[kx] - Sx*C[kz];
+  Cy = C[ky] - Sy*C[kz];
+
+  // Compute the edge functions, in double precision if one vanishes
+  U = Cx*By - Cy*Bx;
+  V = Ax*Cy - Ay*Cx;
+  W = Bx*Ay - By*Ax;
+  if(U == 0.0f || V == 0.0f || W == 0.0f) {
+    U = (float)((double)Cx*By - (double)Cy*Bx);
+    V = (float)((double)Ax*Cy - (double)Ay*Cx);
+    W = (float)((double)Bx*Ay - (double)By*Ax);
+  }
+
+  // Require the edge functions to share the sign of an unculled face
+  det = U + V + W;
+  if(cull == PICK_CULL_NONE) {
+    side = (det < 0.0f) ? -1.0f : 1.0f;
+  }
+  else {
+    side = (cull == PICK_CULL_FRONT) ? -1.0f : 1.0f;
+  }
+  if(U * side < 0.0f || V * side < 0.0f || W * side < 0.0f) {
+    return PICK_MISS;
+  }
+
+  // Take triangles whose determinant is below the tolerance squared as
+  // edge-on, as intersectTriangle() does
+  if(det * side <= epsilon * epsilon) {
+    return PICK_MISS;
+  }
+
+  // Interpolate the sheared z coordinates to find the distance
+  t = Sz * (U*A[kz] + V*B[kz] + W*C[kz])/det;
+  return (t > epsilon) ? t : PICK_MISS;
+}
+
+// Find the nearest hit among triangles [first, last)
+void PickEngine::pickRange(const PickRay& ray, unsigned int first, unsigned int last,
+                           float* t_out, unsigned int* id_out) const {
+
+  const float* tri;
+  float t, t_best = PICK_MISS;
+  unsigned int id_best = UINT_MAX;
+  TriangleTest test = watertight ? intersectWatertight : intersectTriangle;
+
+  for(unsigned int i=first; i<last; i++) {
+    tri = &triangle_vertices[9*i];
+    t = test(ray.origin, ray.dir, tri, tri+3, tri+6, ray.cull, ray.epsilon);
+    if(t < t_best) {
+      t_best = t;
+      id_best = i;
+    }
+  }
+  *t_out = t_best;
+  *id_out = id_best;
+}
+
+// Scan triangles [first, last) across up to max_threads threads
+void PickEngine::scanRange(const PickRay& ray, unsigned int first, unsigned int last,
+                           unsigned int max_threads, float* t_best,
+                           unsigned int* id_best) const {
+
+  unsigned int count = last - first, threads, chunk;
+  std::vector<std::thread> workers;
+  std::vector<float> t_out;
+  std::vector<unsigned int> id_out;
+
+  // Split the triangles between the threads
+  threads = std::min(max_threads, count/MIN_TRIANGLES_PER_THREAD + 1);
+  chunk = (count + threads - 1)/threads;
+  t_out.resize(threads);
+  id_out.resize(threads);
+  for(unsigned int i=1; i<threads; i++) {
+    workers.push_back(std::thread(&PickEngine::pickRange, this, std::cref(ray),
+                                  first + std::min(i*chunk, count),
+                                  first + std::min((i+1)*chunk, count),
+                                  &t_out[i], &id_out[i]));
+  }
+  pickRange(ray, first, first + std::min(chunk, count), &t_out[0], &id_out[0]);
+
+  // Merge the per-thread results
+  for(unsigned int i=0; i<threads; i++) {
+    if(i > 0) {
+      workers[i-1].join();
+    }
+    if(t_out[i] < *t_best) {
+      *t_best = t_out[i];
+      *id_best = id_out[i];
+    }
+  }
+}
+
+// Test the ray against each object's sphere, then its box
+void PickEngine::orderObjects(const PickRay& ray, std::vector<ObjectEntry>* entries) const {
+
+  glm::vec3 inv_dir = PickBVH::inverseDirection(ray.dir), G;
+  ObjectEntry entry;
+  float b, c;
+
+  entries->clear();
+  for(unsigned int i=0; i<object_bounds.size(); i++) {
+    const ObjectBounds& bounds = object_bounds[i];
+
+    // Reject objects whose sphere lies off the ray or behind its origin
+    G = ray.origin - bounds.center;
+    b = glm::dot(G, ray.dir);
+    c = glm::dot(G, G) - bounds.radius * bounds.radius;
+    if(c > 0.0f && (b > 0.0f || b*b < c)) {
+      continue;
+    }
+
+    // Find the entry distance into the box
+    entry.t = PickBVH::intersectBox(ray.origin, inv_dir, &bounds.min[0],
+                                    &bounds.max[0], FLT_MAX);
+    if(entry.t >= 0.0f) {
+      entry.object = i;
+      entries->push_back(entry);
+    }
+  }
+  std::sort(entries->begin(), entries->end());
+}
+
+PickResult PickEngine::pick(const PickRay& ray) const {
+  return pickRay(ray, num_threads);
+}
+
+// Pick one ray, scanning unaccelerated objects on up to max_threads threads
+PickResult PickEngine::pickRay(const PickRay& ray, unsigned int max_threads) const {
+
+  std::vector<ObjectEntry> entries;
+  float t_best = PICK_MISS;
+  unsigned int id_best = UINT_MAX, object, last;
+
+  // Traverse the BVH if one has been built
+  if(!scene_bvh.empty()) {
+    t_best = scene_bvh.intersect(ray, watertight ? intersectWatertight : intersectTriangle, 
+                                 &id_best);
+    return makeResult(id_best, t_best, ray);
+  }
+
+  // Scan the objects front to back until the next one starts behind the hit
+  orderObjects(ray, &entries);
+  for(unsigned int i=0; i<entries.size() && entries[i].t < t_best; i++) {
+    object = entries[i].object;
+    last = (object + 1 < first_triangle.size()) ? first_triangle[object+1] : triangleCount();
+    scanRange(ray, first_triangle[object], last, max_threads, &t_best, &id_best);
+  }
+  return makeResult(id_best, t_best, ray);
+}
+
+// Pick rays [first, last) of a batch on the calling thread
+void PickEngine::pickRays(const std::vector<PickRay>* rays, std::vector<PickResult>* results,
+                          unsigned int first, unsigned int last) const {
+  for(unsigned int i=first; i<last; i++) {
+    (*results)[i] = pickRay((*rays)[i], 1);
+  }
+}
+
+void PickEngine::pickBatch(const std::vector<PickRay>& rays,
+                           std::vector<PickResult>* results) const {
+
+  unsigned int count = rays.size(), threads, chunk;
+  std::vector<std::thread> workers;
+
+  results->resize(count);
+  threads = std::max(1u, std::min(num_threads, count));
+  chunk = (count + threads - 1)/threads;
+  for(unsigned int i=1; i<threads; i++) {
+    workers.push_back(std::thread(&PickEngine::pickRays, this, &rays, results,
+                                  std::min(i*chunk, count), std::min((i+1)*chunk, count)));
+  }
+  pickRays(&rays, results, 0, std::min(chunk, count));
+  for(unsigned int i=0; i<workers.size(); i++) {
+    workers[i].join();
+  }
+}
+
+// Packet p holds 9 runs of width floats, one for each coordinate of
+// each vertex, so lane j of every run belongs to triangle p*width + j
+void PickEngine::packTriangles(unsigned int width, std::vector<float>* packets) const {
+
+  unsigned int num_packets = (triangleCount() + width - 1)/width;
+
+  packets->assign(num_packets * 9 * width, 0.0f);
+  for(unsigned int i=0; i<triangleCount(); i++) {
+    for(unsigned int c=0; c<9; c++) {
+      (*packets)[(i/width*9 + c)*width + i%width] = triangle_vertices[9*i + c];
+    }
+  }
+}
+
+// Run c of the output holds coordinate c%3 of M for c < 3, of E = K - M
+// for c < 6 and of F = L - M otherwise, one float per triangle
+void PickEngine::precomputeTriangles(unsigned int object, std::vector<float>* tris) const {
+
+  unsigned int first = first_triangle[object];
+  unsigned int count = ((object + 1 < first_triangle.size()) ? 
+                        first_triangle[object+1] : triangleCount()) - first;
+  const float* tri;
+
+  tris->resize(9 * count);
+  for(unsigned int i=0; i<count; i++) {
+    tri = &triangle_vertices[9*(first + i)];
+    for(unsigned int j=0; j<3; j++) {
+      (*tris)[j*count + i] = tri[6+j];
+      (*tris)[(3+j)*count + i] = tri[j] - tri[6+j];
+      (*tris)[(6+j)*count + i] = tri[3+j] - tri[6+j];
+    }
+  }
+}
+
+// Split the objects between the threads
+void PickEngine::selectFrustum(const PickFrustum& frustum, 
+                               std::vector<unsigned char>* selected) const {
+
+  unsigned int count = objectCount(), threads, chunk;
+  std::vector<std::thread> workers;
+
+  selected->assign(count, SELECT_OUT);
+  threads = std::max(1u, std::min(num_threads, count));
+  chunk = (count + threads - 1)/threads;
+  for(unsigned int i=1; i<threads; i++) {
+    workers.push_back(std::thread(&PickEngine::selectObjects, this, &frustum, selected,
+                                  std::min(i*chunk, count), std::min((i+1)*chunk, count)));
+  }
+  selectObjects(&frustum, selected, 0, std::min(chunk, count));
+  for(unsigned int i=0; i<workers.size(); i++) {
+    workers[i].join();
+  }
+}
+
+// Select objects whose boxes lie inside the frustum, and objects whose
+// boxes straddle it if one of their triangles is inside
+void PickEngine::selectObjects(const PickFrustum* frustum, std::vector<unsigned char>* selected,
+                               unsigned int start, unsigned int end) const {
+
+  unsigned int last;
+  const float* tri;
+
+  for(unsigned int i=start; i<end; i++) {
+    (*selected)[i] = boxInFrustum(*frustum, object_bounds[i].min, object_bounds[i].max);
+    if((*selected)[i] != SELECT_CHECK) {
+      continue;
+    }
+    (*selected)[i] = SELECT_OUT;
+    last = (i + 1 < first_triangle.size()) ? first_triangle[i+1] : triangleCount();
+    for(unsigned int j=first_triangle[i]; j<last; j++) {
+      tri = &triangle_vertices[9*j];
+      if(triangleInFrustum(*frustum, tri, tri+3, tri+6)) {
+        (*selected)[i] = SELECT_IN;
+        break;
+      }
+    }
+  }
+}
+
+// Split the objects between the threads
+void PickEngine::selectLasso(const glm::mat4& mvp, const std::vector<glm::vec2>& polygon,
+                             std::vector<unsigned char>* selected) const {
+
+  unsigned int count = objectCount(), threads, chunk;
+  std::vector<std::thread> workers;
+
+  selected->assign(count, SELECT_OUT);
+  if(polygon.size() < 3) {
+    return;
+  }
+  threads = std::max(1u, std::min(num_threads, count));
+  chunk = (count + threads - 1)/threads;
+  for(unsigned int i=1; i<threads; i++) {
+    workers.push_back(std::thread(&PickEngine::lassoObjects, this, &mvp, &polygon, selected,
+                                  std::min(i*chunk, count), std::min((i+1)*chunk, count)));
+  }
+  lassoObjects(&mvp, &polygon, selected, 0, std::min(chunk, count));
+  for(unsigned int i=0; i<workers.size(); i++) {
+    workers[i].join();
+  }
+}
+
+// Project the vertices of each object whose box reaches into the
+// polygon's bounding rectangle, and select the object if one of them
+// lands inside the polygon. Vertices at or behind the eye have no
+// screen position and are skipped.
+void PickEngine::lassoObjects(const glm::mat4* mvp, const std::vector<glm::vec2>* polygon,
+                              std::vector<unsigned char>* selected,
+                              unsigned int start, unsigned int end) const {
+
+  glm::vec2 lo = (*polygon)[0], hi = (*polygon)[0];
+  PickFrustum frustum;
+  unsigned int last;
+  glm::vec4 clip;
+
+  for(size_t i=1; i<polygon->size(); i++) {
+    lo = glm::min(lo, (*polygon)[i]);
+    hi = glm::max(hi, (*polygon)[i]);
+  }
+  frustum = screenFrustum(*mvp, lo, hi);
+
+  for(unsigned int i=start; i<end; i++) {
+    if(boxInFrustum(frustum, object_bounds[i].min, object_bounds[i].max) == SELECT_OUT) {
+      continue;
+    }
+    last = (i + 1 < first_vertex.size()) ? first_vertex[i+1] : scene_positions.size()/3;
+    for(unsigned int j=first_vertex[i]; j<last; j++) {
+      clip = *mvp * glm::vec4(scene_positions[3*j], scene_positions[3*j+1], 
+                              scene_positions[3*j+2], 1.0f);
+      if(clip.w > 0.0f && clip.z >= -clip.w && clip.z <= clip.w &&
+         pointInPolygon(glm::vec2(clip.x/clip.w, clip.y/clip.w), *polygon)) {
+        (*selected)[i] = SELECT_IN;
+        break;
+      }
+    }
+  }
+}
+
+// Same test as point_in_polygon() in clgl_pick_selection.cl. Each edge
+// crossing the horizontal line through p to the right of p flips the result.
+bool PickEngine::pointInPolygon(const glm::vec2& p, const std::vector<glm::vec2>& polygon) {
+
+  bool inside = false;
+
+  for(size_t j=0, k=polygon.size()-1; j<polygon.size(); k=j++) {
+    const glm::vec2& a = polygon[j];
+    const glm::vec2& b = polygon[k];
+    if((a.y > p.y) != (b.y > p.y) &&
+       p.x < (b.x - a.x) * (p.y - a.y) / (b.y - a.y) + a.x) {
+      inside = !inside;
+    }
+  }
+  return inside;
+}
+
+// The planes are the clip-space planes x = x0*w, x = x1*w, y = y0*w,
+// y = y1*w, z = -w and z = w carried back through the MVP matrix, and the
+// corners are the rectangle's corners on the near and far planes
+PickFrustum PickEngine::screenFrustum(const glm::mat4& mvp, 
+                                      const glm::vec2& a, const glm::vec2& b) {
+
+  glm::vec2 lo = glm::min(a, b), hi = glm::max(a, b);
+  glm::mat4 mvp_t = glm::transpose(mvp), mvp_inv = glm::inverse(mvp);
+  glm::vec4 corner;
+  PickFrustum frustum;
+
+  frustum.planes[0] = mvp_t * glm::vec4(1.0f, 0.0f, 0.0f, -lo.x);
+  frustum.planes[1] = mvp_t * glm::vec4(-1.0f, 0.0f, 0.0f, hi.x);
+  frustum.planes[2] = mvp_t * glm::vec4(0.0f, 1.0f, 0.0f, -lo.y);
+  frustum.planes[3] = mvp_t * glm::vec4(0.0f, -1.0f, 0.0f, hi.y);
+  frustum.planes[4] = mvp_t * glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+  frustum.planes[5] = mvp_t * glm::vec4(0.0f, 0.0f, -1.0f, 1.0f);
+  for(int i=0; i<8; i++) {
+    corner = mvp_inv * glm::vec4((i & 1) ? hi.x : lo.x, (i & 2) ? hi.y : lo.y, 
+                                 (i & 4) ? 1.0f : -1.0f, 1.0f);
+    frustum.corners[i] = glm::vec3(corner) / corner.w;
+  }
+  return frustum;
+}
+
+// A box is outside if its farthest corner along a plane's normal is
+// outside that plane, and inside if its nearest corner is inside every plane
+SelectState PickEngine::boxInFrustum(const PickFrustum& frustum, 
+                                     const glm::vec3& lo, const glm::vec3& hi) {
+
+  SelectState state = SELECT_IN;
+  glm::vec3 n, p_far, p_near;
+
+  for(int i=0; i<6; i++) {
+    n = glm::vec3(frustum.planes[i]);
+    for(int j=0; j<3; j++) {
+      p_far[j] = (n[j] >= 0.0f) ? hi[j] : lo[j];
+      p_near[j] = (n[j] >= 0.0f) ? lo[j] : hi[j];
+    }
+    if(glm::dot(n, p_far) + frustum.planes[i].w < 0.0f) {
+      return SELECT_OUT;
+    }
+    if(glm::dot(n, p_near) + frustum.planes[i].w < 0.0f) {
+      state = SELECT_CHECK;
+    }
+  }
+  return state;
+}
+
+// A triangle misses the frustum if its vertices lie outside one of the
+// frustum's planes, or if the frustum's corners lie on one side of the
+// triangle's plane. Triangles passing near an edge of the frustum may
+// still be reported.
+bool PickEngine::triangleInFrustum(const PickFrustum& frustum, 
+                                   const float* k, const float* l, const float* m) {
+
+  glm::vec3 K(k[0], k[1], k[2]), L(l[0], l[1], l[2]), M(m[0], m[1], m[2]), n;
+  unsigned int above = 0, below = 0;
+  float d;
+
+  for(int i=0; i<6; i++) {
+    n = glm::vec3(frustum.planes[i]);
+    d = frustum.planes[i].w;
+    if(glm::dot(n, K) + d < 0.0f && glm::dot(n, L) + d < 0.0f && glm::dot(n, M) + d < 0.0f) {
+      return false;
+    }
+  }
+  n = glm::cross(L - K, M - K);
+  for(int i=0; i<8; i++) {
+    d = glm::dot(n, frustum.corners[i] - K);
+    above += (d > 0.0f);
+    below += (d < 0.0f);
+  }
+  return above < 8 && below < 8;
+}
+
+unsigned int PickEngine::triangleObject(unsigned int triangle) const {
+  return std::upper_bound(first_triangle.begin(), first_triangle.end(), triangle)
+         - first_triangle.begin() - 1;
+}
+
+// Recompute k and l for the hit triangle to find its barycentric coordinates
+PickResult PickEngine::makeResult(unsigned int triangle, float t,
+                                  const PickRay& ray) const {
+
+  PickResult result;
+  glm::vec3 K, L, M, E, F, G;
+  const float* tri;
+  float det, k, l;
+
+  result.t = t;
+  if(triangle == UINT_MAX || t >= PICK_MISS) {
+    result.object = UINT_MAX;
+    result.triangle = 0;
+    result.barycentric = glm::vec3(0.0f);
+    result.point = glm::vec3(0.0f);
+    return result;
+  }
+  result.object = triangleObject(triangle);
+  result.triangle = triangle - first_triangle[result.object];
+
+  tri = &triangle_vertices[9*triangle];
+  K = glm::vec3(tri[0], tri[1], tri[2]);
+  L = glm::vec3(tri[3], tri[4], tri[5]);
+  M = glm::vec3(tri[6], tri[7], tri[8]);
+  E = K - M;
+  F = L - M;
+  G = ray.origin - M;
+  det = glm::dot(glm::cross(ray.dir, F), E);
+  k = glm::dot(glm::cross(ray.dir, F), G)/det;
+  l = glm::dot(glm::cross(G, E), ray.dir)/det;
+  result.barycentric = glm::vec3(k, l, 1.0f - k - l);
+  result.point = K*k + L*l + M*(1.0f - k - l);
+  return result;
+}
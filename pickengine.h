@@ -0,0 +1,189 @@
+#ifndef PICKENGINE_H
+#define PICKENGINE_H
+
+#include <cfloat>
+#include <climits>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "colladadata.h"
+#include "pickbvh.h"
+
+// Distance of a miss, which also bounds how far a ray reaches. It's the
+// largest float so that picks have no far limit at any world scale.
+#define PICK_MISS FLT_MAX
+#define PICK_EPSILON 0.0001f          // Default tolerance of a ray
+#define PICK_RELATIVE_EPSILON 1e-5f   // Default tolerance per unit of scene size
+
+// Faces a pick ignores, numbered as in clgl_pick_selection.cl. Back faces
+// give a negative determinant in intersectTriangle().
+enum PickCull : int {
+  PICK_CULL_NONE = 0,
+  PICK_CULL_BACK = 1,
+  PICK_CULL_FRONT = 2
+};
+
+// Ray in the coordinate system of the meshes
+struct PickRay {
+  glm::vec3 origin;
+  glm::vec3 dir;            // Unit length
+  PickCull cull;            // Faces the ray passes through
+  float epsilon;            // Smallest distance accepted as a hit
+  PickRay() : cull(PICK_CULL_BACK), epsilon(PICK_EPSILON) {};
+};
+
+// Result of a pick, in the coordinate system of the meshes
+struct PickResult {
+  unsigned int object;      // Selected object, UINT_MAX if nothing was hit
+  unsigned int triangle;    // Triangle index within the object
+  float t;                  // Distance along the ray
+  glm::vec3 barycentric;    // Weights of the triangle's three vertices
+  glm::vec3 point;          // Hit point on the triangle
+};
+
+// Bounds of one object, computed when the geometries are set
+struct ObjectBounds {
+  glm::vec3 min, max;       // Axis-aligned box
+  glm::vec3 center;         // Bounding sphere
+  float radius;
+};
+
+// Object whose bounds are hit by a ray, and the distance to its bounds
+struct ObjectEntry {
+  float t;
+  unsigned int object;
+  bool operator<(const ObjectEntry& e) const { return t < e.t; }
+};
+
+// Volume selected by a screen rectangle, in the coordinate system of the
+// meshes. A point p is inside plane i when dot(planes[i], (p, 1)) >= 0.
+struct PickFrustum {
+  glm::vec4 planes[6];
+  glm::vec3 corners[8];
+};
+
+// Relation of an object to a selection, numbered as in
+// clgl_pick_selection.cl
+enum SelectState : unsigned char {
+  SELECT_OUT = 0,           // Not selected
+  SELECT_IN = 1,            // Selected
+  SELECT_CHECK = 2          // Bounds straddle the selection, test the triangles
+};
+
+// Ray picking over a set of COLLADA meshes without OpenGL or OpenCL.
+// The meshes are packed into scene-wide vertex and index arrays, which
+// the OpenCL path uploads as they are, and into a flat per-triangle
+// vertex array. The CPU backend traverses a BVH over that array. When
+// acceleration is disabled, it visits the objects whose bounds the ray
+// hits in front-to-back order and scans each one across several threads.
+class PickEngine {
+
+public:
+  PickEngine();
+
+  // The BVH points into triangle_vertices, so an engine can't be copied
+  // or moved. Deleting the copy operations also suppresses the moves.
+  PickEngine(const PickEngine&) = delete;
+  PickEngine& operator=(const PickEngine&) = delete;
+
+  void setGeometries(std::vector<ColGeom>*);
+  void setThreadCount(unsigned int);
+  void setAcceleration(bool);
+
+  // Choose the watertight triangle test, which never lets a ray slip
+  // between triangles sharing an edge, over the faster default test
+  void setWatertight(bool enable) { watertight = enable; }
+  bool isWatertight() const { return watertight; }
+
+  // Find the nearest triangle hit by the ray
+  PickResult pick(const PickRay&) const;
+
+  // Tolerance for rays in this scene, given per unit of the scene's size,
+  // so that picks behave the same at any world scale
+  float epsilon(float relative) const { return relative * scene_scale; }
+
+  // Pick many rays at once, splitting the rays between the threads
+  void pickBatch(const std::vector<PickRay>&, std::vector<PickResult>*) const;
+
+  // List the objects whose bounds the ray enters, nearest first
+  void orderObjects(const PickRay&, std::vector<ObjectEntry>*) const;
+
+  // Select the objects with a triangle in the frustum. selected holds a
+  // SelectState for each object.
+  void selectFrustum(const PickFrustum&, std::vector<unsigned char>* selected) const;
+
+  // Volume seen through the rectangle between two corners given in
+  // normalized device coordinates
+  static PickFrustum screenFrustum(const glm::mat4& mvp, 
+                                   const glm::vec2&, const glm::vec2&);
+
+  // Select the objects with a vertex inside a polygon given in normalized
+  // device coordinates, culling objects outside the polygon's bounding
+  // rectangle first
+  void selectLasso(const glm::mat4& mvp, const std::vector<glm::vec2>& polygon,
+                   std::vector<unsigned char>* selected) const;
+
+  // Even-odd test of a point against a closed polygon
+  static bool pointInPolygon(const glm::vec2&, const std::vector<glm::vec2>&);
+
+  static SelectState boxInFrustum(const PickFrustum&, const glm::vec3&, const glm::vec3&);
+  static bool triangleInFrustum(const PickFrustum&, 
+                                const float*, const float*, const float*);
+
+  // Complete a hit on a scene triangle with its object and barycentrics
+  PickResult makeResult(unsigned int, float, const PickRay&) const;
+  unsigned int triangleObject(unsigned int) const;
+
+  // Packed scene data
+  const std::vector<float>& positions() const { return scene_positions; }
+  const std::vector<unsigned int>& indices() const { return scene_indices; }
+  const std::vector<unsigned int>& firstTriangles() const { return first_triangle; }
+  const std::vector<unsigned int>& firstVertices() const { return first_vertex; }
+  unsigned int objectCount() const { return first_triangle.size(); }
+  unsigned int triangleCount() const { return scene_indices.size()/3; }
+  const PickBVH& bvh() const { return scene_bvh; }
+  const std::vector<ObjectBounds>& bounds() const { return object_bounds; }
+
+  // Pack the triangles into structure-of-arrays packets of the given
+  // width, padding the last packet with degenerate triangles
+  void packTriangles(unsigned int, std::vector<float>*) const;
+
+  // Store an object's triangles as a vertex and two edges, each
+  // coordinate in its own run of floats
+  void precomputeTriangles(unsigned int, std::vector<float>*) const;
+
+  static float intersectTriangle(const glm::vec3&, const glm::vec3&,
+                                 const float*, const float*, const float*,
+                                 PickCull, float);
+  static float intersectWatertight(const glm::vec3&, const glm::vec3&,
+                                   const float*, const float*, const float*,
+                                   PickCull, float);
+
+private:
+  void pickRange(const PickRay&, unsigned int, unsigned int,
+                 float*, unsigned int*) const;
+  void scanRange(const PickRay&, unsigned int, unsigned int, unsigned int,
+                 float*, unsigned int*) const;
+  PickResult pickRay(const PickRay&, unsigned int) const;
+  void pickRays(const std::vector<PickRay>*, std::vector<PickResult>*,
+                unsigned int, unsigned int) const;
+  void selectObjects(const PickFrustum*, std::vector<unsigned char>*,
+                     unsigned int, unsigned int) const;
+  void lassoObjects(const glm::mat4*, const std::vector<glm::vec2>*,
+                    std::vector<unsigned char>*, unsigned int, unsigned int) const;
+
+  std::vector<float> scene_positions;       // xyz of every vertex
+  std::vector<unsigned int> scene_indices;  // Three indices per triangle
+  std::vector<unsigned int> first_triangle; // First triangle of each object
+  std::vector<unsigned int> first_vertex;   // First vertex of each object
+  std::vector<ObjectBounds> object_bounds;
+  std::vector<float> triangle_vertices;     // Nine floats per triangle
+  PickBVH scene_bvh;
+  float scene_scale;                        // Diagonal of the scene's box
+  unsigned int num_threads;
+  bool accelerate;
+  bool watertight;
+};
+
+#endif
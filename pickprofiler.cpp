@@ -0,0 +1,83 @@
+#include "pickprofiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+
+double PickProfiler::now() {
+  return std::chrono::duration<double>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void PickProfiler::record(const std::string& stage, double seconds) {
+
+  if(!active) {
+    return;
+  }
+  StageSamples& samples = stages[stage];
+  if(samples.seconds.size() < PROFILE_WINDOW) {
+    samples.seconds.push_back(seconds);
+  }
+  else {
+    samples.seconds[samples.next] = seconds;
+  }
+  samples.next = (samples.next + 1) % PROFILE_WINDOW;
+  samples.total++;
+}
+
+cl_event* PickProfiler::event(const std::string& stage) {
+
+  if(!active) {
+    return NULL;
+  }
+  pending.push_back(std::make_pair(stage, (cl_event)NULL));
+  return &pending.back().second;
+}
+
+void PickProfiler::addEvent(const std::string& stage, cl_event e) {
+
+  if(!active || e == NULL) {
+    return;
+  }
+  clRetainEvent(e);
+  pending.push_back(std::make_pair(stage, e));
+}
+
+// Time each command from its start to its end on the device
+void PickProfiler::resolveEvents() {
+
+  cl_ulong start, end;
+
+  for(std::list<std::pair<std::string, cl_event> >::iterator it = pending.begin(); 
+      it != pending.end(); it++) {
+    if(it->second == NULL) {
+      continue;
+    }
+    if(clGetEventProfilingInfo(it->second, CL_PROFILING_COMMAND_START, 
+                               sizeof(start), &start, NULL) == CL_SUCCESS &&
+       clGetEventProfilingInfo(it->second, CL_PROFILING_COMMAND_END, 
+                               sizeof(end), &end, NULL) == CL_SUCCESS) {
+      record(it->first, (end - start) * 1e-9);
+    }
+    clReleaseEvent(it->second);
+  }
+  pending.clear();
+}
+
+void PickProfiler::dump(std::ostream& os) const {
+
+  std::vector<double> sorted;
+
+  os << std::left << std::setw(20) << "Stage" << std::right << std::setw(10) << "Count" 
+     << std::setw(14) << "p50 (us)" << std::setw(14) << "p99 (us)" << std::endl;
+  for(std::map<std::string, StageSamples>::const_iterator it = stages.begin(); 
+      it != stages.end(); it++) {
+    sorted = it->second.seconds;
+    std::sort(sorted.begin(), sorted.end());
+    os << std::left << std::setw(20) << it->first << std::right 
+       << std::setw(10) << it->second.total << std::fixed << std::setprecision(1)
+       << std::setw(14) << sorted[(sorted.size() - 1) / 2] * 1e6
+       << std::setw(14) << sorted[(sorted.size() - 1) * 99 / 100] * 1e6 << std::endl;
+  }
+  os.unsetf(std::ios::fixed);
+}
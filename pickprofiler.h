@@ -0,0 +1,60 @@
+#ifndef PICKPROFILER_H
+#define PICKPROFILER_H
+
+#include <iostream>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <CL/cl.h>
+
+// Number of recent samples kept for each stage
+#define PROFILE_WINDOW 1024
+
+// Recent durations of one stage, overwriting the oldest once full
+struct StageSamples {
+  std::vector<double> seconds;
+  size_t next;                      // Slot the next sample replaces
+  unsigned long total;              // Samples recorded since the start
+  StageSamples() : next(0), total(0) {};
+};
+
+// Collects the duration of each stage of a pick: host stages timed with
+// a wall clock, and OpenCL commands timed from the events of a queue
+// created with CL_QUEUE_PROFILING_ENABLE. Every method does nothing
+// until the profiler is enabled.
+class PickProfiler {
+
+public:
+  PickProfiler() : active(false) {};
+  void setEnabled(bool enable) { active = enable; }
+  bool enabled() const { return active; }
+
+  // Wall-clock time in seconds
+  static double now();
+
+  // Add a host-side duration to a stage
+  void record(const std::string&, double);
+
+  // Slot for the event of a command, or NULL when disabled, to pass as
+  // the last argument of a clEnqueue function
+  cl_event* event(const std::string&);
+
+  // Track an event the caller already holds, retaining it
+  void addEvent(const std::string&, cl_event);
+
+  // Record the execution time of every tracked event, which must have
+  // completed, and release them
+  void resolveEvents();
+
+  // Print the count, median and 99th percentile of every stage
+  void dump(std::ostream&) const;
+
+private:
+  bool active;
+  std::map<std::string, StageSamples> stages;
+  std::list<std::pair<std::string, cl_event> > pending;
+};
+
+#endif
@@ -0,0 +1,301 @@
+#include "pickscheduler.h"
+#include "programcache.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+#define RANGE_KERNEL_FUNC "clgl_pick_range"
+#define REDUCE_KERNEL_FUNC "clgl_reduce_min"
+
+// Weight of the newest measurement in each device's rate
+#define RATE_SMOOTHING 0.25
+
+// Rate of a device that hasn't been measured yet
+#define RATE_UNMEASURED 0.0
+
+// Smallest fraction of the scene given to a device, so that slow devices
+// keep being measured
+#define MIN_SHARE 0.01
+
+// Release whichever OpenCL objects of a device have been created
+static void release_device(PickDevice* d) {
+
+  cl_mem buffers[] = {d->vbo, d->ibo, d->t_out, d->id_out, d->t_result, d->id_result};
+
+  for(size_t i=0; i<sizeof(buffers)/sizeof(buffers[0]); i++) {
+    if(buffers[i] != NULL) {
+      clReleaseMemObject(buffers[i]);
+    }
+  }
+  if(d->range_kernel != NULL) {
+    clReleaseKernel(d->range_kernel);
+  }
+  if(d->reduce_kernel != NULL) {
+    clReleaseKernel(d->reduce_kernel);
+  }
+  if(d->program != NULL) {
+    clReleaseProgram(d->program);
+  }
+  if(d->queue != NULL) {
+    clReleaseCommandQueue(d->queue);
+  }
+  if(d->context != NULL) {
+    clReleaseContext(d->context);
+  }
+}
+
+// Create a context, queue, kernels and scene copy for one device. A device
+// that can't be set up is released and left out rather than ending the
+// application, since the other devices can still pick.
+bool PickScheduler::initDevice(cl_device_id device, const std::string& source,
+                               const char* options) {
+
+  const std::vector<float>& positions = engine->positions();
+  const std::vector<unsigned int>& indices = engine->indices();
+  unsigned int num_triangles = engine->triangleCount();
+  size_t num_groups;
+  PickDevice d = PickDevice();
+  int err;
+
+  d.device = device;
+  d.context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+  if(err == CL_SUCCESS) {
+    d.queue = clCreateCommandQueue(d.context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+  }
+  if(err < 0) {
+    std::cerr << "Skipping a device: couldn't create a context and queue" << std::endl;
+    release_device(&d);
+    return false;
+  }
+
+  // Create the program and kernels
+  d.program = ProgramCache::tryBuild(d.context, device, source, options);
+  if(d.program == NULL) {
+    std::cerr << "Skipping a device: couldn't build the program" << std::endl;
+    release_device(&d);
+    return false;
+  }
+  d.range_kernel = clCreateKernel(d.program, RANGE_KERNEL_FUNC, &err);
+  if(err == CL_SUCCESS) {
+    d.reduce_kernel = clCreateKernel(d.program, REDUCE_KERNEL_FUNC, &err);
+  }
+  if(err < 0) {
+    std::cerr << "Skipping a device: couldn't create a kernel: " << err << std::endl;
+    release_device(&d);
+    return false;
+  };
+  clGetKernelWorkGroupInfo(d.range_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                           sizeof(d.group_size), &d.group_size, NULL);
+  clGetKernelWorkGroupInfo(d.reduce_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, 
+                           sizeof(d.reduce_group_size), &d.reduce_group_size, NULL);
+
+  // Copy the scene, and size the per-group buffers for the whole scene
+  // so that any range fits
+  num_groups = (num_triangles + d.group_size - 1)/d.group_size;
+  d.vbo = clCreateBuffer(d.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
+                         positions.size() * sizeof(float), (void*)&positions[0], &err);
+  if(err == CL_SUCCESS) {
+    d.ibo = clCreateBuffer(d.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
+                           indices.size() * sizeof(cl_uint), (void*)&indices[0], &err);
+  }
+  if(err == CL_SUCCESS) {
+    d.t_out = clCreateBuffer(d.context, CL_MEM_READ_WRITE, 
+                             num_groups * sizeof(float), NULL, &err);
+  }
+  if(err == CL_SUCCESS) {
+    d.id_out = clCreateBuffer(d.context, CL_MEM_READ_WRITE, 
+                              num_groups * sizeof(cl_uint), NULL, &err);
+  }
+  if(err == CL_SUCCESS) {
+    d.t_result = clCreateBuffer(d.context, CL_MEM_WRITE_ONLY, sizeof(float), NULL, &err);
+  }
+  if(err == CL_SUCCESS) {
+    d.id_result = clCreateBuffer(d.context, CL_MEM_WRITE_ONLY, sizeof(cl_uint), NULL, &err);
+  }
+  if(err < 0) {
+    std::cerr << "Skipping a device: couldn't create a buffer object" << std::endl;
+    release_device(&d);
+    return false;
+  }
+
+  d.rate = RATE_UNMEASURED;
+  d.first = d.count = 0;
+  devices.push_back(d);
+  return true;
+}
+
+void PickScheduler::init(const PickEngine* e, const std::string& source,
+                         const char* options) {
+
+  std::vector<cl_platform_id> platforms;
+  std::vector<cl_device_id> device_ids;
+  cl_uint num_platforms, num_devices;
+
+  release();
+  engine = e;
+  if(engine->triangleCount() == 0) {
+    return;
+  }
+
+  // Visit every device of every platform
+  if(clGetPlatformIDs(0, NULL, &num_platforms) < 0 || num_platforms == 0) {
+    return;
+  }
+  platforms.resize(num_platforms);
+  clGetPlatformIDs(num_platforms, &platforms[0], NULL);
+  for(cl_uint i=0; i<num_platforms; i++) {
+    if(clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &num_devices) < 0 ||
+       num_devices == 0) {
+      continue;
+    }
+    device_ids.resize(num_devices);
+    clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, num_devices, &device_ids[0], NULL);
+    for(cl_uint j=0; j<num_devices; j++) {
+      initDevice(device_ids[j], source, options);
+    }
+  }
+  assignRanges();
+}
+
+void PickScheduler::release() {
+
+  for(size_t i=0; i<devices.size(); i++) {
+    release_device(&devices[i]);
+  }
+  devices.clear();
+}
+
+// Split the scene into consecutive ranges in proportion to the rates.
+// Until every device has been measured, each gets an equal range.
+void PickScheduler::assignRanges() {
+
+  unsigned int num_triangles = engine->triangleCount(), first = 0;
+  std::vector<double> rates(devices.size(), 1.0);
+  double total = 0.0, floor = 0.0, share = 0.0;
+  bool measured = true;
+
+  for(size_t i=0; i<devices.size(); i++) {
+    measured = measured && devices[i].rate != RATE_UNMEASURED;
+    floor = std::max(floor, devices[i].rate * MIN_SHARE);
+  }
+  for(size_t i=0; i<devices.size(); i++) {
+    if(measured) {
+      rates[i] = std::max(devices[i].rate, floor);
+    }
+    total += rates[i];
+  }
+  for(size_t i=0; i<devices.size(); i++) {
+    share += rates[i];
+    devices[i].first = first;
+    if(i + 1 == devices.size()) {
+      first = num_triangles;
+    }
+    else {
+      first = (unsigned int)(num_triangles * (share / total));
+    }
+    devices[i].count = first - devices[i].first;
+  }
+}
+
+// Launch the range kernel and reduction, and read the result without waiting
+void PickScheduler::enqueuePick(PickDevice* d, const PickRay& ray) {
+
+  cl_float4 O = {{ray.origin.x, ray.origin.y, ray.origin.z, ray.epsilon}};
+  cl_float4 D = {{ray.dir.x, ray.dir.y, ray.dir.z, (float)ray.cull}};
+  size_t num_groups = std::max((d->count + d->group_size - 1)/d->group_size, (size_t)1);
+  size_t global_size = num_groups * d->group_size;
+  cl_uint count = num_groups, out_index = 0;
+  int err;
+
+  // Set kernel arguments
+  err = clSetKernelArg(d->range_kernel, 0, sizeof(cl_float4), &O);
+  err |= clSetKernelArg(d->range_kernel, 1, sizeof(cl_float4), &D);
+  err |= clSetKernelArg(d->range_kernel, 2, sizeof(cl_mem), &d->vbo);
+  err |= clSetKernelArg(d->range_kernel, 3, sizeof(cl_mem), &d->ibo);
+  err |= clSetKernelArg(d->range_kernel, 4, sizeof(cl_uint), &d->first);
+  err |= clSetKernelArg(d->range_kernel, 5, sizeof(cl_uint), &d->count);
+  err |= clSetKernelArg(d->range_kernel, 6, sizeof(cl_mem), &d->t_out);
+  err |= clSetKernelArg(d->range_kernel, 7, sizeof(cl_mem), &d->id_out);
+  err |= clSetKernelArg(d->range_kernel, 8, d->group_size*sizeof(float), NULL);
+  err |= clSetKernelArg(d->range_kernel, 9, d->group_size*sizeof(cl_uint), NULL);
+  err |= clSetKernelArg(d->reduce_kernel, 0, sizeof(cl_mem), &d->t_out);
+  err |= clSetKernelArg(d->reduce_kernel, 1, sizeof(cl_mem), &d->id_out);
+  err |= clSetKernelArg(d->reduce_kernel, 2, sizeof(cl_uint), &count);
+  err |= clSetKernelArg(d->reduce_kernel, 3, sizeof(cl_mem), &d->t_result);
+  err |= clSetKernelArg(d->reduce_kernel, 4, sizeof(cl_mem), &d->id_result);
+  err |= clSetKernelArg(d->reduce_kernel, 5, sizeof(cl_uint), &out_index);
+  err |= clSetKernelArg(d->reduce_kernel, 6, d->reduce_group_size*sizeof(float), NULL);
+  err |= clSetKernelArg(d->reduce_kernel, 7, d->reduce_group_size*sizeof(cl_uint), NULL);
+  if(err < 0) {
+    std::cerr << "Couldn't set a kernel argument: " << err << std::endl;
+    exit(1);
+  };
+
+  // Execute the kernels and read the result
+  err = clEnqueueNDRangeKernel(d->queue, d->range_kernel, 1, NULL, &global_size, 
+                               &d->group_size, 0, NULL, &d->start);
+  err |= clEnqueueNDRangeKernel(d->queue, d->reduce_kernel, 1, NULL, &d->reduce_group_size, 
+                                &d->reduce_group_size, 0, NULL, NULL);
+  if(err < 0) {
+    std::cerr << "Couldn't enqueue the kernel" << std::endl;
+    exit(1);   
+  }
+  err = clEnqueueReadBuffer(d->queue, d->t_result, CL_FALSE, 0, 
+                            sizeof(float), &d->t, 0, NULL, NULL);
+  err |= clEnqueueReadBuffer(d->queue, d->id_result, CL_FALSE, 0, 
+                             sizeof(cl_uint), &d->id, 0, NULL, &d->done);
+  if(err < 0) {
+    std::cerr << "Couldn't read the buffer" << std::endl;
+    exit(1);   
+  }
+  clFlush(d->queue);
+}
+
+// Blend the device's throughput over its last pick into its rate, timing
+// from the start of the range kernel to the end of the read. The first
+// measurement replaces the placeholder rate.
+void PickScheduler::updateRate(PickDevice* d) {
+
+  cl_ulong start, end;
+  double rate;
+
+  clGetEventProfilingInfo(d->start, CL_PROFILING_COMMAND_START, 
+                          sizeof(start), &start, NULL);
+  clGetEventProfilingInfo(d->done, CL_PROFILING_COMMAND_END, 
+                          sizeof(end), &end, NULL);
+  if(end > start && d->count > 0) {
+    rate = d->count / ((end - start) * 1e-9);
+    if(d->rate == RATE_UNMEASURED) {
+      d->rate = rate;
+    }
+    else {
+      d->rate = (1.0 - RATE_SMOOTHING) * d->rate + RATE_SMOOTHING * rate;
+    }
+  }
+  clReleaseEvent(d->start);
+  clReleaseEvent(d->done);
+}
+
+PickResult PickScheduler::pick(const PickRay& ray) {
+
+  float t_best = PICK_MISS;
+  unsigned int id_best = UINT_MAX;
+
+  // Start every device before waiting for any of them
+  for(size_t i=0; i<devices.size(); i++) {
+    enqueuePick(&devices[i], ray);
+  }
+
+  // Merge the nearest hits
+  for(size_t i=0; i<devices.size(); i++) {
+    clWaitForEvents(1, &devices[i].done);
+    if(devices[i].count > 0 && devices[i].t < t_best) {
+      t_best = devices[i].t;
+      id_best = devices[i].id;
+    }
+    updateRate(&devices[i]);
+  }
+  assignRanges();
+  return engine->makeResult(id_best, t_best, ray);
+}
@@ -0,0 +1,63 @@
+#ifndef PICKSCHEDULER_H
+#define PICKSCHEDULER_H
+
+#include <string>
+#include <vector>
+
+#include <CL/cl.h>
+
+#include "pickengine.h"
+
+// One OpenCL device taking part in multi-device picks
+struct PickDevice {
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;           // Created with profiling enabled
+  cl_program program;
+  cl_kernel range_kernel, reduce_kernel;
+  cl_mem vbo, ibo;                  // Copy of the whole scene
+  cl_mem t_out, id_out;             // Per-group distances and triangles
+  cl_mem t_result, id_result;       // Reduced distance and triangle
+  size_t group_size, reduce_group_size;
+  unsigned int first, count;        // Triangles assigned to the device
+  double rate;                      // Triangles per second, 0 until measured
+  float t;                          // Host copies of the results
+  cl_uint id;
+  cl_event start, done;             // Range kernel and final read
+};
+
+// Splits scene picks across every device of every OpenCL platform. Each
+// device holds the whole scene, so rebalancing only moves the boundaries
+// of the triangle ranges. The ranges start out equal, and after each pick
+// they are resized in proportion to the throughput each device measured.
+class PickScheduler {
+
+public:
+  PickScheduler() : engine(NULL) {};
+
+  // Set up every device with the program source and the engine's scene,
+  // skipping devices that fail
+  void init(const PickEngine*, const std::string&, const char*);
+
+  // Release the devices' OpenCL objects. The destructor doesn't, since a
+  // global scheduler is destroyed after the OpenCL runtime may be gone,
+  // so owners call this explicitly. Calling it again does nothing.
+  void release();
+
+  // Find the nearest triangle hit by the ray on all devices at once
+  PickResult pick(const PickRay&);
+
+  unsigned int deviceCount() const { return devices.size(); }
+  const std::vector<PickDevice>& deviceList() const { return devices; }
+
+private:
+  bool initDevice(cl_device_id, const std::string&, const char*);
+  void enqueuePick(PickDevice*, const PickRay&);
+  void updateRate(PickDevice*);
+  void assignRanges();
+
+  std::vector<PickDevice> devices;
+  const PickEngine* engine;
+};
+
+#endif
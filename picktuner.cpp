@@ -0,0 +1,125 @@
+#include "picktuner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TUNE_RUNS 5
+#define MAX_TRIS_PER_ITEM 16
+
+// Time the fastest of several runs, after one run to warm up
+double PickTuner::timeRuns(const PickTuning& tuning, void (*run)(const PickTuning&)) {
+
+  double best = 0.0, seconds;
+
+  run(tuning);
+  for(int i=0; i<TUNE_RUNS; i++) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    run(tuning);
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if(i == 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+  return best;
+}
+
+// Find the stored configuration for a key. Each line of the file holds
+// a key, a work-group size and a triangles-per-item factor, tab-separated.
+bool PickTuner::load(const std::string& key, PickTuning* tuning) {
+
+  std::ifstream ifs(TUNING_FILE);
+  std::string line, file_key;
+
+  while(std::getline(ifs, line)) {
+    std::istringstream fields(line);
+    if(std::getline(fields, file_key, '\t') && file_key == key &&
+       fields >> tuning->group_size >> tuning->tris_per_item) {
+      return tuning->group_size > 0 && tuning->tris_per_item > 0;
+    }
+  }
+  return false;
+}
+
+// Replace the key's line in the file, renaming a temporary file as
+// ProgramCache does
+void PickTuner::save(const std::string& key, const PickTuning& tuning) {
+
+  std::ifstream ifs(TUNING_FILE);
+  std::vector<std::string> lines;
+  std::string line;
+  std::ostringstream tmp_name;
+
+  while(std::getline(ifs, line)) {
+    if(line.compare(0, key.size() + 1, key + "\t") != 0) {
+      lines.push_back(line);
+    }
+  }
+  ifs.close();
+
+  mkdir(PROGRAM_CACHE_DIR, 0755);
+  tmp_name << TUNING_FILE << "." << getpid() << ".tmp";
+  std::ofstream ofs(tmp_name.str().c_str());
+  for(size_t i=0; i<lines.size(); i++) {
+    ofs << lines[i] << "\n";
+  }
+  ofs << key << "\t" << tuning.group_size << "\t" << tuning.tris_per_item << "\n";
+  ofs.close();
+  if(!ofs.good() || rename(tmp_name.str().c_str(), TUNING_FILE) != 0) {
+    remove(tmp_name.str().c_str());
+  }
+}
+
+// Try work-group sizes from the kernel's preferred multiple up to
+// max_size, each with 1 to MAX_TRIS_PER_ITEM triangles per work-item.
+// options are the build options of the kernel's program, which change
+// the code being timed.
+PickTuning PickTuner::tune(cl_device_id device, cl_kernel kernel, const char* name,
+                           const char* options, size_t max_size, unsigned int num_triangles, 
+                           void (*run)(const PickTuning&)) {
+
+  std::ostringstream key_stream;
+  std::string key;
+  PickTuning tuning, best;
+  size_t multiple = 1;
+  double seconds, best_seconds = 0.0;
+
+  key_stream << ProgramCache::deviceKey(device) << "|" << name << "|" 
+             << (options ? options : "") << "|" << num_triangles;
+  key = key_stream.str();
+  if(getenv("PICK_RETUNE") == NULL && load(key, &best) && best.group_size <= max_size) {
+    return best;
+  }
+
+  clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                           sizeof(multiple), &multiple, NULL);
+  best.group_size = max_size;
+  best.tris_per_item = 1;
+  for(tuning.group_size = std::min(std::max(multiple, (size_t)1), max_size); ; 
+      tuning.group_size = std::min(2 * tuning.group_size, max_size)) {
+    for(tuning.tris_per_item = 1; tuning.tris_per_item <= MAX_TRIS_PER_ITEM; 
+        tuning.tris_per_item *= 2) {
+      seconds = timeRuns(tuning, run);
+      if(best_seconds == 0.0 || seconds < best_seconds) {
+        best_seconds = seconds;
+        best = tuning;
+      }
+    }
+    if(tuning.group_size == max_size) {
+      break;
+    }
+  }
+
+  std::cout << "Tuned " << name << ": " << best.group_size << " work-items per group, "
+            << best.tris_per_item << " triangles per work-item" << std::endl;
+  save(key, best);
+  return best;
+}
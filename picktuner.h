@@ -0,0 +1,36 @@
+#ifndef PICKTUNER_H
+#define PICKTUNER_H
+
+#include <string>
+
+#include <CL/cl.h>
+
+#include "programcache.h"
+
+#define TUNING_FILE PROGRAM_CACHE_DIR "/tuning.txt"
+
+// Launch configuration of the triangle-parallel pick kernels
+struct PickTuning {
+  size_t group_size;            // Work-items per work-group
+  unsigned int tris_per_item;   // Triangles tested by each work-item
+};
+
+// Benchmarks candidate launch configurations of a pick kernel and keeps
+// the fastest one in TUNING_FILE, keyed by device, driver, kernel, build
+// options and triangle count. Later runs with the same key reuse the stored result
+// unless the PICK_RETUNE environment variable is set.
+class PickTuner {
+
+public:
+  // The run function performs one complete pick with the given
+  // configuration and returns once its results are available
+  static PickTuning tune(cl_device_id, cl_kernel, const char*, const char*,
+                         size_t, unsigned int, void (*)(const PickTuning&));
+
+private:
+  static double timeRuns(const PickTuning&, void (*)(const PickTuning&));
+  static bool load(const std::string&, PickTuning*);
+  static void save(const std::string&, const PickTuning&);
+};
+
+#endif
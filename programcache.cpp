@@ -0,0 +1,197 @@
+#include "programcache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "CLBIN1"
+
+// Read a string-valued device parameter
+static std::string device_string(cl_device_id device, cl_device_info param) {
+
+  size_t size;
+  std::vector<char> value;
+
+  clGetDeviceInfo(device, param, 0, NULL, &size);
+  value.resize(size + 1, '\0');
+  clGetDeviceInfo(device, param, size, &value[0], NULL);
+  return std::string(&value[0]);
+}
+
+// 64-bit FNV-1a hash
+static unsigned long long fnv1a(const std::string& text) {
+
+  unsigned long long hash = 14695981039346656037ULL;
+
+  for(size_t i=0; i<text.size(); i++) {
+    hash ^= (unsigned char)text[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+std::string ProgramCache::deviceKey(cl_device_id device) {
+  return device_string(device, CL_DEVICE_NAME) + "|" + 
+         device_string(device, CL_DEVICE_VENDOR) + "|" + 
+         device_string(device, CL_DEVICE_VERSION) + "|" + 
+         device_string(device, CL_DRIVER_VERSION);
+}
+
+// Describe everything that affects the compiled binary. The source is
+// represented by its hash so the key stays short.
+std::string ProgramCache::cacheKey(cl_device_id device, const std::string& source,
+                                   const char* options) {
+
+  std::ostringstream key;
+
+  key << deviceKey(device) << "|"
+      << (options ? options : "") << "|" << std::hex << fnv1a(source);
+  return key.str();
+}
+
+std::string ProgramCache::cachePath(const std::string& key) {
+
+  std::ostringstream path;
+
+  path << PROGRAM_CACHE_DIR << "/" << std::hex << fnv1a(key) << ".bin";
+  return path.str();
+}
+
+// Create and build a program from a cached binary, or return NULL if the
+// file is missing, belongs to a different key or is rejected by the driver.
+// Files hold the magic string, the full key and then the binary.
+cl_program ProgramCache::loadBinary(cl_context context, cl_device_id device,
+                                    const std::string& key, const char* options) {
+
+  std::ifstream ifs(cachePath(key).c_str(), std::ifstream::binary);
+  std::string magic, file_key;
+  std::vector<unsigned char> binary;
+  const unsigned char* binary_ptr;
+  size_t binary_size;
+  cl_program program;
+  cl_int err, status;
+
+  if(!ifs.good()) {
+    return NULL;
+  }
+  std::getline(ifs, magic);
+  std::getline(ifs, file_key);
+  if(magic != CACHE_MAGIC || file_key != key) {
+    return NULL;
+  }
+  binary.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+  if(binary.empty()) {
+    return NULL;
+  }
+
+  binary_ptr = &binary[0];
+  binary_size = binary.size();
+  program = clCreateProgramWithBinary(context, 1, &device, &binary_size, 
+                                      &binary_ptr, &status, &err);
+  if(err < 0 || status < 0) {
+    return NULL;
+  }
+  err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+  if(err < 0) {
+    clReleaseProgram(program);
+    return NULL;
+  }
+  return program;
+}
+
+// Write the program's binary next to its key, renaming a temporary file
+// so that concurrent launches never read a partial binary
+void ProgramCache::saveBinary(cl_program program, const std::string& key) {
+
+  std::string path = cachePath(key), tmp_path;
+  std::vector<unsigned char> binary;
+  unsigned char* binary_ptr;
+  size_t binary_size;
+  std::ostringstream tmp_name;
+
+  if(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), 
+                      &binary_size, NULL) < 0 || binary_size == 0) {
+    return;
+  }
+  binary.resize(binary_size);
+  binary_ptr = &binary[0];
+  if(clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*), 
+                      &binary_ptr, NULL) < 0) {
+    return;
+  }
+
+  mkdir(PROGRAM_CACHE_DIR, 0755);
+  tmp_name << path << "." << getpid() << ".tmp";
+  tmp_path = tmp_name.str();
+  std::ofstream ofs(tmp_path.c_str(), std::ofstream::binary);
+  ofs << CACHE_MAGIC << "\n" << key << "\n";
+  ofs.write((const char*)binary_ptr, binary_size);
+  ofs.close();
+  if(!ofs.good() || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    remove(tmp_path.c_str());
+  }
+}
+
+cl_program ProgramCache::build(cl_context context, cl_device_id device,
+                               const std::string& source, const char* options) {
+
+  cl_program program = tryBuild(context, device, source, options);
+
+  if(program == NULL) {
+    exit(1);
+  }
+  return program;
+}
+
+cl_program ProgramCache::tryBuild(cl_context context, cl_device_id device,
+                                  const std::string& source, const char* options) {
+
+  std::string key = cacheKey(device, source, options);
+  const char *program_chars;
+  char *program_log;
+  size_t program_size, log_size;
+  cl_program program;
+  int err;
+
+  // Use the cached binary when it is valid
+  program = loadBinary(context, device, key, options);
+  if(program != NULL) {
+    return program;
+  }
+
+  // Create program from source
+  program_chars = source.c_str();
+  program_size = source.size();
+  program = clCreateProgramWithSource(context, 1, &program_chars, 
+                                      &program_size, &err);
+  if(err < 0) {
+    std::cerr << "Couldn't create the program" << std::endl;
+    return NULL;
+  }
+
+  // Build program 
+  err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+  if(err < 0) {
+
+    // Find size of log and print to std output 
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 
+                          0, NULL, &log_size);
+    program_log = new char[log_size + 1];
+    program_log[log_size] = '\0';
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 
+                          log_size + 1, (void*)program_log, NULL);
+    std::cout << program_log << std::endl;
+    delete[] program_log;
+    clReleaseProgram(program);
+    return NULL;
+  }
+
+  saveBinary(program, key);
+  return program;
+}
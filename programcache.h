@@ -0,0 +1,32 @@
+#ifndef PROGRAMCACHE_H
+#define PROGRAMCACHE_H
+
+#include <string>
+
+#include <CL/cl.h>
+
+#define PROGRAM_CACHE_DIR "kernel_cache"
+
+// Builds OpenCL programs, keeping their binaries on disk. A cached binary
+// is used only if it was built for the same device, driver version,
+// build options and source text, and is rebuilt from source otherwise.
+class ProgramCache {
+
+public:
+  // Exit if the program can't be built
+  static cl_program build(cl_context, cl_device_id, const std::string&, const char*);
+
+  // Print the build log and return NULL if the program can't be built
+  static cl_program tryBuild(cl_context, cl_device_id, const std::string&, const char*);
+
+  // Identify a device and its driver, for other per-device caches
+  static std::string deviceKey(cl_device_id);
+
+private:
+  static std::string cacheKey(cl_device_id, const std::string&, const char*);
+  static std::string cachePath(const std::string&);
+  static cl_program loadBinary(cl_context, cl_device_id, const std::string&, const char*);
+  static void saveBinary(cl_program, const std::string&);
+};
+
+#endif